@@ -1,6 +1,7 @@
 // client.cpp This is Universal Campus Client for ALL campuses
-// Usage: ./client <CampusName> <Department> <Password>
+// Usage: ./client <CampusName> <Department> <Password> [ServerIP] [options]
 // Example: ./client Lahore Admissions NU-LHR-123
+//          ./client Lahore Admissions NU-LHR-123 --batch notices.txt --format json
 
 // Network communication headers
 #include <arpa/inet.h>      // IP address conversion functions
@@ -10,25 +11,140 @@
 #include <unistd.h>         // POSIX API (close, read, write)
 // Standard C++ headers  
 #include <iostream>         // Console input/output
+#include <fstream>          // Batch input files
+#include <mutex>            // Serialised output, send queue
+#include <condition_variable>   // Send queue wakeups
+#include <deque>            // Send queue, recent message ids
+#include <unordered_map>    // Messages awaiting an ack
+#include <unordered_set>    // Recent message ids
+#include <vector>           // Latency samples
+#include <algorithm>        // Percentiles
+#include <random>           // First message id
 #include <string>           // String manipulation
 #include <thread>           // Multi-threading support
 #include <atomic>           // Thread-safe atomic operations
 #include <cstring>          // C string functions
 #include <signal.h>         // Signal handling (Ctrl+C)
 #include <chrono>           // Time utilities
+// Project headers
+#include "protocol.h"       // Framed wire protocol
+#include "compress.h"       // Payload compression
 
 using namespace std;
 
 const int TCP_PORT = 54000;
 const int UDP_PORT = 54001;
 const int BUFFER_SIZE = 8192;
+const size_t BATCH_SEND_BYTES = 64 * 1024;  // Most the sender thread writes per send()
+const size_t MAX_QUEUED_BYTES = 4 * 1024 * 1024;    // Queue size that blocks the producer
+const int MAX_SEND_ATTEMPTS = 3;            // Sends of a message before it counts as failed
+const size_t RECENT_ID_COUNT = 65536;       // Received message ids kept for duplicate suppression
+const size_t LATENCY_SAMPLES = 1024;        // Round trips kept for the percentiles
+const int RECONNECT_INITIAL_MS = 50;        // First backoff after a failed reconnect
+const int RECONNECT_MAX_MS = 2000;          // Backoff cap; kept low, recovery time matters most
+const int CONNECT_TIMEOUT_S = 5;            // Longest a connect or auth reply may take
+
+enum class OutputFormat {
+    MENU,           // Interactive: boxed messages and prompts
+    TSV,            // Batch: one tab-separated record per line
+    JSON            // Batch: one JSON object per line
+};
 
 atomic<bool> client_running{true};
 int tcp_socket = -1, udp_socket = -1;
 string campus_name, department, password, server_ip = "127.0.0.1";
+sockaddr_in server_addr;
+bool framed = false;        // Server accepted Proto:2 at auth time
+atomic<int> campus_id{-1};  // Assigned in AUTH_OK, used by binary heartbeats
+atomic<uint64_t> connection_id{0};  // Changes with every reconnect
+string session_token;       // From the last AUTH_OK; resumes the session on reconnect
+bool reconnect_enabled = true;  // --no-reconnect: exit when the server goes away
+atomic<bool> connected{false};  // tcp_socket is authenticated and may be written
+mutex send_lock;            // Held by the sender while writing, so a dead socket is not closed under it
+mutex heartbeat_lock;
+condition_variable heartbeat_wakeup;
+bool heartbeat_due = false; // Send one now; set after a reconnect, under heartbeat_lock
+string tcp_pending;         // Reassembly buffer for the TCP stream
+bool compress_enabled = true;   // Offer Compress:deflate at auth (--no-compress)
+size_t compress_threshold = COMPRESS_THRESHOLD;
+string compress_dictionary;     // --compress-dict; empty = none
+bool server_deflate = false;    // Server accepted Compress:deflate
+bool use_dictionary = false;    // Server announced our dictionary's id
+OutputFormat output_format = OutputFormat::MENU;
+mutex output_lock;              // The TCP and UDP receivers print concurrently
+atomic<bool> closing{false};    // We half-closed the connection; EOF is expected
+uint32_t send_window = 256;     // --window: unacknowledged frames allowed; 0 = no flow control
+bool credit_flow = false;       // Server granted a Window and sends FRAME_CREDIT
+bool acks_enabled = true;       // Ask for delivery acks at auth (--no-ack)
+bool server_acks = false;       // Server accepted Ack:1: messages carry ids
+int ack_timeout = 10;           // --ack-timeout: seconds before an unacknowledged message is resent
+atomic<uint64_t> next_message_id{0};    // Random start, so ids of separate clients never meet
+
+// Messages waiting for the sender thread. The menu and batch reader only
+// queue; send_loop writes, keeping at most send_window frames the server has
+// not yet credited, so a slow server holds data here rather than in socket
+// buffers, and the producer blocks once MAX_QUEUED_BYTES are waiting.
+struct QueuedMessage {
+    string packet;              // Encoded, one frame or line
+    uint64_t id = 0;            // Message id, 0 if no ack is expected
+};
+
+struct SendQueue {
+    mutex lock;
+    condition_variable changed;
+    deque<QueuedMessage> messages;
+    size_t queued_bytes = 0;
+    uint32_t in_flight = 0;     // Sent frames not yet credited
+};
+SendQueue send_queue;
+
+// Messages sent with an id whose ack has not come back. The first ack for a
+// message settles it (later ones from other receivers are ignored); one not
+// settled ack_timeout seconds after it was written is sent again, with the
+// same id, up to MAX_SEND_ATTEMPTS times.
+struct PendingMessage {
+    string packet;              // Kept for resending
+    string target_campus, target_dept;
+    size_t line = 0;            // Batch input line, 0 in the menu
+    chrono::steady_clock::time_point queued_at;
+    chrono::steady_clock::time_point sent_at = chrono::steady_clock::time_point::max();
+    int attempts = 1;
+};
+
+struct DeliveryTracker {
+    mutex lock;
+    unordered_map<uint64_t, PendingMessage> pending;
+    size_t delivered = 0, spooled = 0, forwarded = 0, failed = 0;
+    deque<double> round_trips_ms;   // Queue to DELIVERED ack, the last LATENCY_SAMPLES
+};
+DeliveryTracker deliveries;
+
+// Ids of messages already shown; a resent copy is acknowledged again but not
+// shown twice. Only the TCP receiver thread touches it.
+struct RecentIds {
+    unordered_set<uint64_t> seen;
+    deque<uint64_t> order;
+    
+    // False if id was already seen
+    bool insert(uint64_t id) {
+        if(!seen.insert(id).second) return false;
+        order.push_back(id);
+        if(order.size() > RECENT_ID_COUNT) {
+            seen.erase(order.front());
+            order.pop_front();
+        }
+        return true;
+    }
+};
+RecentIds recent_ids;
+
+// Banners and status lines; stderr in batch mode so stdout stays machine-readable
+ostream &status_stream() {
+    return output_format == OutputFormat::MENU ? cout : cerr;
+}
 
 void signal_handler(int sig) {
-    cout << "\nSignal received. Exiting campus client...\n";
+    status_stream() << "\nSignal received. Exiting campus client...\n";
     client_running = false;
     if(tcp_socket != -1) shutdown(tcp_socket, SHUT_RDWR);
 }
@@ -44,9 +160,270 @@ void display_menu() {
     cout << "Choice: ";
 }
 
-void receive_tcp_messages() {
+// Escape text for one TSV field or the inside of a JSON string
+string escape_field(string_view text) {
+    bool json = output_format == OutputFormat::JSON;
+    string escaped;
+    escaped.reserve(text.size());
+    for(char c : text) {
+        switch(c) {
+        case '\\': escaped += "\\\\"; break;
+        case '\t': escaped += "\\t"; break;
+        case '\n': escaped += "\\n"; break;
+        case '\r': escaped += "\\r"; break;
+        case '"': escaped += json ? "\\\"" : "\""; break;
+        default:
+            if(json && (unsigned char)c < 0x20) {
+                char code[8];
+                snprintf(code, sizeof(code), "\\u%04x", (unsigned char)c);
+                escaped += code;
+            } else {
+                escaped += c;
+            }
+        }
+    }
+    return escaped;
+}
+
+// One received message, broadcast or server notice as a line on stdout:
+//   TSV:  <type>\t<campus>\t<department>\t<text>
+//   JSON: {"type":"<type>","campus":"..","department":"..","text":".."}
+// Caller holds output_lock
+void write_record(const char *type, string_view campus, string_view dept, string_view text) {
+    if(output_format == OutputFormat::JSON) {
+        cout << "{\"type\":\"" << type << "\",\"campus\":\"" << escape_field(campus)
+             << "\",\"department\":\"" << escape_field(dept) << "\",\"text\":\"" << escape_field(text) << "\"}\n";
+    } else {
+        cout << type << '\t' << escape_field(campus) << '\t' << escape_field(dept) << '\t'
+             << escape_field(text) << '\n';
+    }
+    cout.flush();
+}
+
+void display_message(string_view from_campus, string_view from_dept, string_view message) {
+    lock_guard<mutex> lock(output_lock);
+    if(output_format != OutputFormat::MENU) {
+        write_record(from_campus.empty() ? "notice" : "message", from_campus, from_dept, message);
+        return;
+    }
+    cout << "\n========================================\n";
+    cout << "NEW MESSAGE RECEIVED\n";
+    cout << "========================================\n";
+    if(!from_campus.empty()) {
+        cout << "From: " << from_campus << " (" << from_dept << ")\n";
+        cout << "Message: " << message << "\n";
+    } else {
+        cout << message << "\n";
+    }
+    cout << "========================================\n";
+    cout << "Choice: ";
+    cout.flush();
+}
+
+const char *ack_status_name(uint8_t status) {
+    switch(status) {
+    case ACK_DELIVERED: return "delivered";
+    case ACK_SPOOLED: return "spooled";
+    case ACK_FORWARDED: return "forwarded";
+    default: return "failed";
+    }
+}
+
+// How a message ended: acked by campus/dept (the receiver, or the target as
+// addressed for server acks and timeouts) round_trip_ms after it was queued;
+// negative when it timed out.
+void display_ack(uint8_t status, string_view campus, string_view dept, size_t line, double round_trip_ms) {
+    lock_guard<mutex> lock(output_lock);
+    char details[64] = "";
+    if(output_format != OutputFormat::MENU) {
+        int length = line > 0 ? snprintf(details, sizeof(details), " line=%zu", line) : 0;
+        if(round_trip_ms >= 0) {
+            snprintf(details + length, sizeof(details) - length, " rtt_ms=%.3f", round_trip_ms);
+        }
+        write_record("ack", campus, dept, string(ack_status_name(status)) + details);
+        return;
+    }
+    cout << "\n[" << ack_status_name(status) << "] " << campus << " (" << dept << ")";
+    if(status == ACK_DELIVERED) {
+        snprintf(details, sizeof(details), "%.2f", round_trip_ms);
+        cout << " received your message in " << details << " ms\n";
+    } else if(status == ACK_SPOOLED) {
+        cout << " is offline; the server will deliver your message when it reconnects\n";
+    } else if(status == ACK_FORWARDED) {
+        cout << " was handed your message but does not acknowledge\n";
+    } else if(round_trip_ms < 0) {
+        cout << " did not acknowledge your message after " << MAX_SEND_ATTEMPTS << " attempts\n";
+    } else {
+        cout << " could not receive your message\n";
+    }
+    cout << "Choice: ";
+    cout.flush();
+}
+
+void display_broadcast(string_view message) {
+    lock_guard<mutex> lock(output_lock);
+    if(output_format != OutputFormat::MENU) {
+        write_record("broadcast", "", "", message);
+        return;
+    }
+    cout << "\n========================================\n";
+    cout << "SERVER BROADCAST\n";
+    cout << "========================================\n";
+    cout << message << "\n";
+    cout << "========================================\n";
+    cout << "Choice: ";
+    cout.flush();
+}
+
+// The server is holding back our traffic for campus/dept, which reads slowly
+void display_throttle(uint8_t action, string_view campus, string_view dept) {
+    lock_guard<mutex> lock(output_lock);
+    if(output_format != OutputFormat::MENU) {
+        write_record("throttle", campus, dept, throttle_action_name(action));
+        return;
+    }
+    cout << "\n[throttled] " << campus << " (" << dept << ") is reading slowly: ";
+    if(action == THROTTLE_BLOCKED) {
+        cout << "the server is holding your messages until it catches up\n";
+    } else if(action == THROTTLE_SHED_OLDEST) {
+        cout << "older messages waiting for it were dropped\n";
+    } else if(action == THROTTLE_SHED_NEWEST) {
+        cout << "your message was dropped for it\n";
+    } else {
+        cout << "it was disconnected and will get its messages when it reconnects\n";
+    }
+    cout << "Choice: ";
+    cout.flush();
+}
+
+// Text protocol: one FROM:<campus>:<dept>:<message> per line
+void display_text_line(const string &msg) {
+    if(msg.find("FROM:") == 0) {
+        size_t colon1 = msg.find(':', 5);
+        size_t colon2 = colon1 == string::npos ? string::npos : msg.find(':', colon1 + 1);
+        
+        if(colon2 != string::npos) {
+            display_message(msg.substr(5, colon1 - 5),
+                            msg.substr(colon1 + 1, colon2 - colon1 - 1),
+                            msg.substr(colon2 + 1));
+            return;
+        }
+    }
+    display_message("", "", msg);
+}
+
+bool queue_message(string packet, uint64_t id = 0, bool wait_for_space = true);
+
+// Settle a message of ours with the ack's outcome
+void handle_ack(const FrameView &frame) {
+    uint64_t id;
+    uint8_t status;
+    if(!decode_ack(frame.payload, id, status)) return;
+    
+    double round_trip_ms;
+    size_t line;
+    {
+        lock_guard<mutex> lock(deliveries.lock);
+        auto it = deliveries.pending.find(id);
+        if(it == deliveries.pending.end()) return;  // Settled already, or another terminal's
+        round_trip_ms = chrono::duration<double, milli>(chrono::steady_clock::now() -
+                                                         it->second.queued_at).count();
+        line = it->second.line;
+        deliveries.pending.erase(it);
+        
+        if(status == ACK_DELIVERED) {
+            deliveries.delivered++;
+            deliveries.round_trips_ms.push_back(round_trip_ms);
+            if(deliveries.round_trips_ms.size() > LATENCY_SAMPLES) deliveries.round_trips_ms.pop_front();
+        }
+        else if(status == ACK_SPOOLED) deliveries.spooled++;
+        else if(status == ACK_FORWARDED) deliveries.forwarded++;
+        else deliveries.failed++;
+    }
+    display_ack(status, frame.campus, frame.department, line, round_trip_ms);
+}
+
+// Show a delivered message and, if it carries an id, acknowledge it to its
+// sender. Never blocks: the ack bypasses the queue limit.
+void receive_delivery(const FrameView &frame) {
+    string_view body = frame.payload;
+    uint64_t id = 0;
+    if(frame.flags & FRAME_FLAG_ID) {
+        if(body.size() < MESSAGE_ID_SIZE) return;
+        id = read_message_id(body);
+        body.remove_prefix(MESSAGE_ID_SIZE);
+    }
+    
+    bool received = true;
+    if(id == 0 || recent_ids.seen.count(id) == 0) {
+        if(frame.flags & FRAME_FLAG_DEFLATE) {
+            string text;
+            bool needs_dictionary = frame.flags & FRAME_FLAG_DICTIONARY;
+            received = inflate_payload(text, body, needs_dictionary ? &compress_dictionary : nullptr,
+                                       MAX_PAYLOAD_SIZE);
+            display_message(frame.campus, frame.department,
+                            received ? string_view(text) : "[undecodable compressed message]");
+        } else {
+            display_message(frame.campus, frame.department, body);
+        }
+        if(id != 0 && received) recent_ids.insert(id);
+    }
+    
+    if(id != 0) {
+        string packet;
+        encode_ack_frame(packet, frame.campus, frame.department, id, received ? ACK_DELIVERED : ACK_FAILED);
+        queue_message(move(packet), 0, false);
+    }
+}
+
+// Show every complete frame or line in tcp_pending; false on a corrupt stream
+bool process_tcp_pending() {
+    size_t consumed = 0;
+    
+    while(consumed < tcp_pending.size()) {
+        const char *data = tcp_pending.data() + consumed;
+        size_t available = tcp_pending.size() - consumed;
+        
+        if(framed) {
+            FrameView frame;
+            size_t frame_size = 0;
+            FrameStatus status = decode_frame(data, available, frame, frame_size);
+            if(status == FrameStatus::INCOMPLETE) break;
+            if(status == FrameStatus::INVALID) return false;
+            consumed += frame_size;
+            if(frame.type == FRAME_CREDIT) {
+                lock_guard<mutex> lock(send_queue.lock);
+                send_queue.in_flight -= min(send_queue.in_flight, decode_credit(frame.payload));
+                send_queue.changed.notify_all();
+                continue;
+            }
+            if(frame.type == FRAME_ACK) handle_ack(frame);
+            if(frame.type == FRAME_THROTTLE && frame.payload.size() == 1) {
+                display_throttle((uint8_t)frame.payload[0], frame.campus, frame.department);
+            }
+            if(frame.type == FRAME_DELIVER) receive_delivery(frame);
+            continue;
+        }
+        
+        const char *newline = (const char*)memchr(data, '\n', available);
+        if(newline == nullptr) break;
+        string line(data, newline - data);
+        consumed += line.size() + 1;
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        display_text_line(line);
+    }
+    tcp_pending.erase(0, consumed);
+    return true;
+}
+
+// Show what the server sends until the connection drops (returns why) or
+// the client stops (returns nullptr)
+const char *read_until_lost() {
     char buffer[BUFFER_SIZE];
     
+    // Bytes that arrived together with AUTH_OK
+    if(!process_tcp_pending()) return "Corrupt data from server";
+    
     while(client_running) {
         fd_set read_set;
         FD_ZERO(&read_set);
@@ -56,44 +433,37 @@ void receive_tcp_messages() {
         int ready = select(tcp_socket + 1, &read_set, NULL, NULL, &timeout);
         
         if(ready > 0 && FD_ISSET(tcp_socket, &read_set)) {
-            ssize_t bytes = recv(tcp_socket, buffer, BUFFER_SIZE - 1, 0);
+            ssize_t bytes = recv(tcp_socket, buffer, BUFFER_SIZE, 0);
             if(bytes > 0) {
-                buffer[bytes] = '\0';
-                cout << "\n========================================\n";
-                cout << "NEW MESSAGE RECEIVED\n";
-                cout << "========================================\n";
-                
-                string msg(buffer);
-                if(msg.find("FROM:") == 0) {
-                    size_t colon1 = msg.find(':', 5);
-                    size_t colon2 = msg.find(':', colon1 + 1);
-                    size_t colon3 = msg.find(':', colon2 + 1);
-                    
-                    if(colon1 != string::npos && colon2 != string::npos && colon3 != string::npos) {
-                        string from_campus = msg.substr(5, colon1 - 5);
-                        string from_dept = msg.substr(colon1 + 1, colon2 - colon1 - 1);
-                        string message = msg.substr(colon3 + 1);
-                        
-                        cout << "From: " << from_campus << " (" << from_dept << ")\n";
-                        cout << "Message: " << message << "\n";
-                    } else {
-                        cout << msg << "\n";
-                    }
-                } else {
-                    cout << msg << "\n";
-                }
-                
-                cout << "========================================\n";
-                cout << "Choice: ";
-                cout.flush();
+                tcp_pending.append(buffer, bytes);
+                if(!process_tcp_pending()) return "Corrupt data from server";
             }
-            else if(bytes == 0) {
-                cout << "\nServer connection lost\n";
-                client_running = false;
-                break;
+            else if(bytes == 0 || errno != EINTR) {
+                return "Server connection lost";
             }
         }
     }
+    return nullptr;
+}
+
+bool reconnect();
+
+// The connection's owner: reads it, and when it drops, connects again
+void receive_tcp_messages() {
+    while(client_running) {
+        const char *reason = read_until_lost();
+        if(reason == nullptr) break;
+        // EOF after our half-close is the server finishing up
+        if(closing) {
+            client_running = false;
+            break;
+        }
+        status_stream() << "\n" << reason << (reconnect_enabled ? ", reconnecting...\n" : "\n");
+        if(!reconnect_enabled || !reconnect()) {
+            client_running = false;
+            break;
+        }
+    }
 }
 
 void receive_udp_broadcasts() {
@@ -112,30 +482,522 @@ void receive_udp_broadcasts() {
         if(ready > 0 && FD_ISSET(udp_socket, &read_set)) {
             ssize_t bytes = recvfrom(udp_socket, buffer, BUFFER_SIZE - 1, 0,
                                     (sockaddr*)&src_addr, &addr_len);
-            if(bytes > 0) {
-                buffer[bytes] = '\0';
-                cout << "\n========================================\n";
-                cout << "SERVER BROADCAST\n";
-                cout << "========================================\n";
-                cout << buffer << "\n";
-                cout << "========================================\n";
-                cout << "Choice: ";
-                cout.flush();
+            if(bytes > 0) display_broadcast(string_view(buffer, bytes));
+        }
+    }
+}
+
+// Value of ",<key>:" in the AUTH_OK line, or "" if absent
+string auth_reply_field(const string &reply, const string &key) {
+    size_t start = reply.find("," + key + ":");
+    if(start == string::npos) return "";
+    start += key.size() + 2;
+    return reply.substr(start, reply.find(',', start) - start);
+}
+
+// Frame a message for the server, compressing payloads from the threshold up
+// when the server negotiated it and putting a non-zero id in front. The
+// uncompressed text must fit a frame too, since receivers without
+// compression get it inflated.
+bool encode_send_frame(string &packet, const string &target_campus, const string &target_dept,
+                       const string &message, uint64_t id) {
+    if(message.size() + MESSAGE_ID_SIZE > MAX_PAYLOAD_SIZE) return false;
+    
+    string compressed;
+    uint16_t flags = 0;
+    if(server_deflate && message.size() >= compress_threshold &&
+       deflate_payload(compressed, message, use_dictionary ? &compress_dictionary : nullptr)) {
+        flags = FRAME_FLAG_DEFLATE | (use_dictionary ? FRAME_FLAG_DICTIONARY : 0);
+    }
+    string_view body = flags != 0 ? compressed : message;
+    if(id == 0) return encode_frame(packet, FRAME_SEND, target_campus, target_dept, body, flags);
+    
+    string payload;
+    payload.reserve(MESSAGE_ID_SIZE + body.size());
+    append_message_id(payload, id);
+    payload.append(body.data(), body.size());
+    return encode_frame(packet, FRAME_SEND, target_campus, target_dept, payload, flags | FRAME_FLAG_ID);
+}
+
+// Append one message for the server in the negotiated protocol. With acks
+// it gets the next message id, returned in id, and is tracked until settled.
+bool encode_send(string &out, const string &target_campus, const string &target_dept,
+                 const string &message, uint64_t &id, size_t line = 0) {
+    id = 0;
+    if(!framed) {
+        out += "SEND:" + target_campus + ":" + target_dept + ":" + message + "\n";
+        return true;
+    }
+    while(server_acks && id == 0) id = next_message_id.fetch_add(1);
+    if(!encode_send_frame(out, target_campus, target_dept, message, id)) return false;
+    if(id != 0) {
+        PendingMessage pending;
+        pending.packet = out;
+        pending.target_campus = target_campus;
+        pending.target_dept = target_dept;
+        pending.line = line;
+        pending.queued_at = chrono::steady_clock::now();
+        lock_guard<mutex> lock(deliveries.lock);
+        deliveries.pending[id] = move(pending);
+    }
+    return true;
+}
+
+bool send_all(const string &data) {
+    size_t offset = 0;
+    while(offset < data.size()) {
+        ssize_t sent = send(tcp_socket, data.data() + offset, data.size() - offset, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        offset += sent;
+    }
+    return true;
+}
+
+enum class ConnectResult {
+    OK,
+    RETRY,          // Network trouble; worth trying again
+    REJECTED        // The server refused us; trying again will not help
+};
+
+// Open a TCP connection and send the auth line: the session token from the
+// last AUTH_OK when reconnecting with one, otherwise the credentials. Leaves
+// the reply line in reply and anything after it in tcp_pending.
+ConnectResult open_session(bool with_session, bool verbose, string &reply) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0) {
+        if(verbose) perror("TCP socket creation failed");
+        return ConnectResult::RETRY;
+    }
+    // Bounds the connect and the wait for AUTH_OK; cleared once we are in
+    timeval timeout = {CONNECT_TIMEOUT_S, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    if(connect(fd, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        if(verbose) perror("Connection failed");
+        close(fd);
+        return ConnectResult::RETRY;
+    }
+    
+    // Authentication
+    string auth_data = with_session ? "Session:" + session_token
+                                    : "Campus:" + campus_name + ",Pass:" + password + ",Dept:" + department;
+    auth_data += ",Proto:" + to_string(PROTO_VERSION);
+    if(compress_enabled) {
+        auth_data += ",Compress:deflate";
+        if(!compress_dictionary.empty()) auth_data += ",Dict:" + to_string(dictionary_id(compress_dictionary));
+    }
+    if(send_window > 0) auth_data += ",Window:" + to_string(send_window);
+    if(acks_enabled) auth_data += ",Ack:1";
+    auth_data += "\n";
+    if(send(fd, auth_data.c_str(), auth_data.size(), MSG_NOSIGNAL) < 0) {
+        if(verbose) perror("Authentication failed");
+        close(fd);
+        return ConnectResult::RETRY;
+    }
+    
+    // The reply is one text line; anything after it is already framed
+    char response[BUFFER_SIZE];
+    size_t line_end = string::npos;
+    tcp_pending.clear();
+    while(line_end == string::npos) {
+        ssize_t bytes = recv(fd, response, BUFFER_SIZE, 0);
+        if(bytes <= 0) break;
+        tcp_pending.append(response, bytes);
+        line_end = tcp_pending.find('\n');
+    }
+    if(line_end == string::npos) {
+        if(verbose) status_stream() << "No reply from server\n";
+        close(fd);
+        return ConnectResult::RETRY;
+    }
+    reply = tcp_pending.substr(0, line_end);
+    tcp_pending.erase(0, line_end + 1);
+    if(reply.find("AUTH_FAIL") != string::npos) {
+        close(fd);
+        return ConnectResult::REJECTED;
+    }
+    
+    timeout = {0, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    tcp_socket = fd;
+    return ConnectResult::OK;
+}
+
+// Connect and authenticate, preferring the session token, and adopt what the
+// server granted. A reconnect must get the same protocol options as the first
+// connection, since queued and unacknowledged messages are already encoded.
+ConnectResult connect_to_server(bool first) {
+    string auth_reply;
+    ConnectResult result = ConnectResult::REJECTED;
+    if(!session_token.empty()) {
+        result = open_session(true, first, auth_reply);
+        // Expired, or signed with a key the server no longer has
+        if(result == ConnectResult::REJECTED) session_token.clear();
+    }
+    if(result == ConnectResult::REJECTED) result = open_session(false, first, auth_reply);
+    if(result == ConnectResult::RETRY) return result;
+    if(first || result == ConnectResult::REJECTED) status_stream() << "Server: " << auth_reply << "\n";
+    if(result == ConnectResult::REJECTED) {
+        status_stream() << "Authentication rejected\n";
+        return result;
+    }
+    
+    bool now_framed = auth_reply_field(auth_reply, "Proto") == to_string(PROTO_VERSION);
+    bool now_deflate = now_framed && auth_reply_field(auth_reply, "Compress") == "deflate";
+    bool now_dictionary = now_deflate && !compress_dictionary.empty() &&
+                          auth_reply_field(auth_reply, "Dict") == to_string(dictionary_id(compress_dictionary));
+    bool now_acks = now_framed && auth_reply_field(auth_reply, "Ack") == "1";
+    if(!first && (now_framed != framed || now_deflate != server_deflate || now_dictionary != use_dictionary ||
+                  now_acks != server_acks)) {
+        status_stream() << "Server: " << auth_reply << "\n";
+        status_stream() << "Server no longer offers the protocol options this client started with\n";
+        close(tcp_socket);
+        tcp_socket = -1;
+        return ConnectResult::REJECTED;
+    }
+    framed = now_framed;
+    server_deflate = now_deflate;
+    use_dictionary = now_dictionary;
+    server_acks = now_acks;
+    
+    if(framed && !auth_reply_field(auth_reply, "Conn").empty()) {
+        campus_id = stoi(auth_reply_field(auth_reply, "Id"));
+        connection_id = stoull(auth_reply_field(auth_reply, "Conn"));
+    }
+    session_token = auth_reply_field(auth_reply, "Session");
+    // The server may grant a smaller window than we asked for
+    string window = auth_reply_field(auth_reply, "Window");
+    lock_guard<mutex> lock(send_queue.lock);
+    credit_flow = framed && !window.empty() && stoul(window) > 0;
+    if(credit_flow) send_window = min<uint32_t>(send_window, stoul(window));
+    send_queue.in_flight = 0;   // Credits owed by the old connection never come
+    return ConnectResult::OK;
+}
+
+// Put every message written on the old connection and not acknowledged back
+// at the head of the queue, oldest first, keeping its id so receivers that
+// did get it show it only once. Messages queued meanwhile follow.
+void replay_unacknowledged() {
+    vector<pair<chrono::steady_clock::time_point, QueuedMessage>> replay;
+    {
+        lock_guard<mutex> lock(deliveries.lock);
+        for(auto &[id, pending] : deliveries.pending) {
+            if(pending.sent_at == chrono::steady_clock::time_point::max()) continue;    // Still queued
+            pending.sent_at = chrono::steady_clock::time_point::max();
+            replay.push_back({pending.queued_at, {pending.packet, id}});
+        }
+    }
+    sort(replay.begin(), replay.end(), [](const auto &a, const auto &b) { return a.first < b.first; });
+    
+    lock_guard<mutex> lock(send_queue.lock);
+    for(auto it = replay.rbegin(); it != replay.rend(); ++it) {
+        send_queue.queued_bytes += it->second.packet.size();
+        send_queue.messages.push_front(move(it->second));
+    }
+}
+
+// Close the dropped connection and connect again, backing off exponentially
+// with jitter so campuses that lost the same server do not return in step.
+// Retries until it works, the server refuses us or the client stops.
+bool reconnect() {
+    {
+        // The sender may be blocked writing to the dead socket
+        shutdown(tcp_socket, SHUT_RDWR);
+        lock_guard<mutex> lock(send_lock);
+        connected = false;
+        close(tcp_socket);
+        tcp_socket = -1;
+    }
+    
+    auto lost_at = chrono::steady_clock::now();
+    mt19937 random(random_device{}());
+    int backoff_ms = RECONNECT_INITIAL_MS;
+    for(int attempt = 1; client_running; attempt++) {
+        ConnectResult result = connect_to_server(false);
+        if(result == ConnectResult::REJECTED) return false;
+        if(result == ConnectResult::OK) {
+            replay_unacknowledged();
+            connected = true;
+            send_queue.changed.notify_all();
+            {
+                // Tells the server our UDP address under the new connection id
+                lock_guard<mutex> lock(heartbeat_lock);
+                heartbeat_due = true;
+            }
+            heartbeat_wakeup.notify_all();
+            double outage_ms = chrono::duration<double, milli>(chrono::steady_clock::now() - lost_at).count();
+            char line[128];
+            snprintf(line, sizeof(line), "Reconnected to central server after %.0f ms (attempt %d)\n",
+                     outage_ms, attempt);
+            status_stream() << line;
+            return true;
+        }
+        
+        // Anywhere from half the backoff to all of it
+        int delay_ms = uniform_int_distribution<int>(backoff_ms / 2, backoff_ms)(random);
+        auto wake = chrono::steady_clock::now() + chrono::milliseconds(delay_ms);
+        while(client_running && chrono::steady_clock::now() < wake) {
+            this_thread::sleep_for(min<chrono::steady_clock::duration>(wake - chrono::steady_clock::now(),
+                                                                      chrono::milliseconds(100)));
+        }
+        backoff_ms = min(backoff_ms * 2, RECONNECT_MAX_MS);
+    }
+    return false;
+}
+
+// Queue one encoded message (id as returned by encode_send), waiting while
+// the queue is full unless wait_for_space is false. False once the client is
+// shutting down.
+bool queue_message(string packet, uint64_t id, bool wait_for_space) {
+    unique_lock<mutex> lock(send_queue.lock);
+    while(wait_for_space && client_running && send_queue.queued_bytes > MAX_QUEUED_BYTES) {
+        send_queue.changed.wait_for(lock, chrono::milliseconds(100));
+    }
+    if(!client_running) return false;
+    send_queue.queued_bytes += packet.size();
+    send_queue.messages.push_back({move(packet), id});
+    send_queue.changed.notify_all();
+    return true;
+}
+
+// Wait until everything queued has been written and, with flow control,
+// credited by the server. False if the connection went away first.
+bool wait_for_sent() {
+    unique_lock<mutex> lock(send_queue.lock);
+    while(client_running && (!send_queue.messages.empty() || (credit_flow && send_queue.in_flight > 0))) {
+        send_queue.changed.wait_for(lock, chrono::milliseconds(100));
+    }
+    return client_running;
+}
+
+// Wait until every message with an id has been settled by an ack or timed
+// out. False if the connection went away first.
+bool wait_for_acks() {
+    while(client_running) {
+        {
+            lock_guard<mutex> lock(deliveries.lock);
+            if(deliveries.pending.empty()) return true;
+        }
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    return false;
+}
+
+// Requeue messages written more than ack_timeout seconds ago and still not
+// acknowledged; give up on those out of attempts
+void resend_unacknowledged() {
+    auto now = chrono::steady_clock::now();
+    vector<QueuedMessage> resend;
+    vector<PendingMessage> expired;
+    {
+        lock_guard<mutex> lock(deliveries.lock);
+        for(auto it = deliveries.pending.begin(); it != deliveries.pending.end();) {
+            PendingMessage &pending = it->second;
+            if(pending.sent_at == chrono::steady_clock::time_point::max() ||
+               now - pending.sent_at < chrono::seconds(ack_timeout)) {
+                ++it;
+            } else if(pending.attempts < MAX_SEND_ATTEMPTS) {
+                pending.attempts++;
+                pending.sent_at = chrono::steady_clock::time_point::max();
+                resend.push_back({pending.packet, it->first});
+                ++it;
+            } else {
+                deliveries.failed++;
+                expired.push_back(move(pending));
+                it = deliveries.pending.erase(it);
             }
         }
     }
+    for(auto &message : resend) queue_message(move(message.packet), message.id, false);
+    for(auto &pending : expired) {
+        display_ack(ACK_FAILED, pending.target_campus, pending.target_dept, pending.line, -1);
+    }
+}
+
+// The client's only TCP writer. Takes as many queued messages as the window
+// allows (up to BATCH_SEND_BYTES) and writes them with one send(). Once a
+// second it also resends messages whose ack is overdue. While reconnecting
+// it writes nothing and messages wait in the queue: a batch is dequeued,
+// written and marked sent under send_lock, so reconnect() never drops the
+// connection between taking a batch and writing it, nor replays before the
+// batch counts as written.
+void send_loop() {
+    string batch;
+    vector<uint64_t> batch_ids;
+    auto next_resend_check = chrono::steady_clock::now();
+    while(client_running) {
+        // Replay after a reconnect covers whatever an outage left unacknowledged
+        if(server_acks && connected && chrono::steady_clock::now() >= next_resend_check) {
+            resend_unacknowledged();
+            next_resend_check = chrono::steady_clock::now() + chrono::seconds(1);
+        }
+        
+        uint32_t count = 0;
+        auto window_open = [&] { return !credit_flow || send_queue.in_flight + count < send_window; };
+        {
+            unique_lock<mutex> lock(send_queue.lock);
+            while(client_running && (!connected || send_queue.messages.empty() || !window_open())) {
+                if(send_queue.changed.wait_for(lock, chrono::milliseconds(100)) == cv_status::timeout) break;
+            }
+        }
+        
+        {
+            lock_guard<mutex> send_guard(send_lock);
+            {
+                lock_guard<mutex> lock(send_queue.lock);
+                while(connected && !send_queue.messages.empty() && window_open() && batch.size() < BATCH_SEND_BYTES) {
+                    QueuedMessage &message = send_queue.messages.front();
+                    batch += message.packet;
+                    if(message.id != 0) batch_ids.push_back(message.id);
+                    send_queue.queued_bytes -= message.packet.size();
+                    send_queue.messages.pop_front();
+                    count++;
+                }
+                if(credit_flow) send_queue.in_flight += count;
+            }
+            
+            // A failed write leaves the reconnect to the receiver thread; messages
+            // with ids in this batch count as written, so they are replayed
+            if(!batch.empty() && !send_all(batch)) shutdown(tcp_socket, SHUT_RDWR);
+            if(!batch_ids.empty()) {
+                // Ack timeouts run from the write, not from the queueing
+                auto now = chrono::steady_clock::now();
+                lock_guard<mutex> lock(deliveries.lock);
+                for(uint64_t id : batch_ids) {
+                    auto it = deliveries.pending.find(id);
+                    if(it != deliveries.pending.end()) it->second.sent_at = now;
+                }
+            }
+        }
+        batch.clear();
+        batch_ids.clear();
+        // Wake producers waiting for queue space, and wait_for_sent
+        send_queue.changed.notify_all();
+    }
+}
+
+// Round-trip percentile (0-100) over the recent DELIVERED acks; caller holds deliveries.lock
+double round_trip_percentile(double percentile) {
+    if(deliveries.round_trips_ms.empty()) return 0;
+    vector<double> sorted(deliveries.round_trips_ms.begin(), deliveries.round_trips_ms.end());
+    size_t rank = (size_t)(percentile / 100 * (sorted.size() - 1) + 0.5);
+    nth_element(sorted.begin(), sorted.begin() + rank, sorted.end());
+    return sorted[rank];
+}
+
+// "<n> delivered, ... awaiting ack" plus round-trip percentiles
+void print_delivery_summary(ostream &out) {
+    lock_guard<mutex> lock(deliveries.lock);
+    out << "Deliveries: " << deliveries.delivered << " delivered, " << deliveries.spooled << " spooled, "
+        << deliveries.forwarded << " forwarded, " << deliveries.failed << " failed, "
+        << deliveries.pending.size() << " awaiting ack\n";
+    if(!deliveries.round_trips_ms.empty()) {
+        char line[128];
+        snprintf(line, sizeof(line), "Round trip (last %zu): p50 %.2f ms, p99 %.2f ms\n",
+                 deliveries.round_trips_ms.size(), round_trip_percentile(50), round_trip_percentile(99));
+        out << line;
+    }
+}
+
+// Batch mode: send every <Campus>:<Dept>:<Message> line of path ("-" for
+// stdin), skipping blank lines and # comments. Lines are queued without
+// waiting on any prompt, and the sender thread pipelines them. Once all are
+// routed (credited) and, with acks, settled, keep printing what arrives for
+// linger seconds (negative = until the server closes or Ctrl+C), then
+// half-close so the server finishes before it hangs up. Returns the exit
+// code: 1 if a line was rejected or a message failed.
+int run_batch(const string &path, int linger) {
+    ifstream file;
+    if(path != "-") {
+        file.open(path);
+        if(!file) {
+            cerr << "Cannot open batch file: " << path << "\n";
+            return 1;
+        }
+    }
+    istream &input = path == "-" ? cin : file;
+    
+    string line;
+    size_t line_number = 0, sent = 0, failed = 0;
+    while(client_running && getline(input, line)) {
+        line_number++;
+        if(!line.empty() && line.back() == '\r') line.pop_back();
+        if(line.empty() || line[0] == '#') continue;
+        
+        size_t first_colon = line.find(':');
+        size_t second_colon = first_colon == string::npos ? string::npos : line.find(':', first_colon + 1);
+        if(first_colon == 0 || second_colon == string::npos || second_colon == first_colon + 1 ||
+           second_colon + 1 == line.size()) {
+            cerr << "Line " << line_number << ": expected <Campus>:<Dept>:<Message>\n";
+            failed++;
+            continue;
+        }
+        string packet;
+        uint64_t id;
+        if(!encode_send(packet, line.substr(0, first_colon),
+                        line.substr(first_colon + 1, second_colon - first_colon - 1),
+                        line.substr(second_colon + 1), id, line_number)) {
+            cerr << "Line " << line_number << ": message too long\n";
+            failed++;
+            continue;
+        }
+        if(!queue_message(move(packet), id)) break;
+        sent++;
+    }
+    if(!wait_for_sent() || (server_acks && !wait_for_acks())) {
+        status_stream() << "Server connection lost while sending\n";
+        return 1;
+    }
+    status_stream() << "Sent " << sent << " message(s)";
+    if(failed > 0) status_stream() << ", " << failed << " line(s) rejected";
+    status_stream() << "\n";
+    if(server_acks) {
+        print_delivery_summary(status_stream());
+        lock_guard<mutex> lock(deliveries.lock);
+        if(deliveries.failed > 0) failed++;
+    }
+    
+    for(int waited = 0; client_running && (linger < 0 || waited < linger * 10); waited++) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    
+    closing = true;
+    shutdown(tcp_socket, SHUT_WR);
+    for(int waited = 0; client_running && waited < 50; waited++) {
+        this_thread::sleep_for(chrono::milliseconds(100));
+    }
+    return failed > 0 ? 1 : 0;
 }
 
 void send_heartbeat(sockaddr_in server_udp_addr) {
+    uint32_t sequence = 0;
+    
     while(client_running) {
-        string heartbeat = "HEARTBEAT:" + campus_name;
-        sendto(udp_socket, heartbeat.c_str(), heartbeat.size(), 0,
-              (sockaddr*)&server_udp_addr, sizeof(server_udp_addr));
+        if(campus_id >= 0 && connection_id != 0) {
+            HeartbeatPacket packet;
+            packet.campus_id = (uint16_t)campus_id;
+            packet.conn_id = connection_id;
+            packet.sequence = sequence++;
+            packet.sent_ns = chrono::duration_cast<chrono::nanoseconds>(
+                chrono::steady_clock::now().time_since_epoch()).count();
+            char heartbeat[HEARTBEAT_PACKET_SIZE];
+            encode_heartbeat(heartbeat, packet);
+            sendto(udp_socket, heartbeat, sizeof(heartbeat), 0,
+                  (sockaddr*)&server_udp_addr, sizeof(server_udp_addr));
+        } else {
+            string heartbeat = "HEARTBEAT:" + campus_name + ":" + department;
+            sendto(udp_socket, heartbeat.c_str(), heartbeat.size(), 0,
+                  (sockaddr*)&server_udp_addr, sizeof(server_udp_addr));
+        }
         
-        // Sleep for 10 seconds with interrupt checks
-        for(int i = 0; i < 60 && client_running; i++) {
-            this_thread::sleep_for(chrono::seconds(1));
+        // Sleep for 60 seconds with interrupt checks, less after a reconnect
+        unique_lock<mutex> lock(heartbeat_lock);
+        for(int i = 0; i < 60 && client_running && !heartbeat_due; i++) {
+            heartbeat_wakeup.wait_for(lock, chrono::seconds(1));
         }
+        heartbeat_due = false;
     }
 }
 
@@ -158,13 +1020,55 @@ int main(int argc, char* argv[]) {
     signal(SIGINT, signal_handler);
     
     // Get credentials from command line
-    if(argc >= 4) {
+    bool usage_error = argc < 4;
+    string batch_path;
+    int linger = 1;
+    for(int i = 4; i < argc && !usage_error; i++) {
+        string arg = argv[i];
+        if(arg == "--batch" && i + 1 < argc) {
+            batch_path = argv[++i];
+            if(output_format == OutputFormat::MENU) output_format = OutputFormat::TSV;
+        } else if(arg == "--format" && i + 1 < argc) {
+            string format = argv[++i];
+            if(format == "tsv") output_format = OutputFormat::TSV;
+            else if(format == "json") output_format = OutputFormat::JSON;
+            else usage_error = true;
+        } else if(arg == "--window" && i + 1 < argc) {
+            send_window = (uint32_t)stoul(argv[++i]);
+        } else if(arg == "--linger" && i + 1 < argc) {
+            linger = atoi(argv[++i]);
+        } else if(arg == "--compress-dict" && i + 1 < argc) {
+            string path = argv[++i];
+            if(!load_dictionary(path, compress_dictionary)) {
+                cout << "Cannot read compression dictionary: " << path << "\n";
+                return 1;
+            }
+        } else if(arg == "--compress-threshold" && i + 1 < argc) {
+            compress_threshold = stoul(argv[++i]);
+        } else if(arg == "--no-compress") {
+            compress_enabled = false;
+        } else if(arg == "--ack-timeout" && i + 1 < argc) {
+            ack_timeout = max(1, atoi(argv[++i]));
+        } else if(arg == "--no-ack") {
+            acks_enabled = false;
+        } else if(arg == "--no-reconnect") {
+            reconnect_enabled = false;
+        } else if(i == 4 && arg.rfind("--", 0) != 0) {
+            server_ip = arg;
+        } else {
+            usage_error = true;
+        }
+    }
+    
+    if(!usage_error) {
         campus_name = argv[1];
         department = argv[2];
         password = argv[3];
-        if(argc >= 5) server_ip = argv[4];
     } else {
-        cout << "Usage: " << argv[0] << " <Campus> <Department> <Password> [ServerIP]\n";
+        cout << "Usage: " << argv[0] << " <Campus> <Department> <Password> [ServerIP]"
+             << " [--batch FILE|-] [--format tsv|json] [--linger SECONDS] [--window FRAMES]"
+             << " [--compress-dict FILE] [--compress-threshold BYTES] [--no-compress]"
+             << " [--ack-timeout SECONDS] [--no-ack] [--no-reconnect]\n";
         cout << "Example: " << argv[0] << " Karachi Academics NU-KHI-123\n";
         cout << "\nAvailable Campuses:\n";
         cout << "  Lahore   Admissions   NU-LHR-123\n";
@@ -172,57 +1076,33 @@ int main(int argc, char* argv[]) {
         cout << "  Peshawar IT           NU-PEW-123\n";
         cout << "  CFD      Sports       NU-CFD-123\n";
         cout << "  Multan   Admissions   NU-MLT-123\n";
+        cout << "\nBatch mode: --batch reads <Campus>:<Dept>:<Message> lines from FILE (or - for\n"
+             << "stdin) and prints received messages on stdout as TSV or JSON lines.\n";
         return 1;
     }
+    if(batch_path.empty()) output_format = OutputFormat::MENU;
     
-    cout << "========================================\n";
-    cout << "NU Information Exchange System - Client\n";
-    cout << "Campus: " << campus_name << "\n";
-    cout << "Department: " << department << "\n";
-    cout << "Server: " << server_ip << "\n";
-    cout << "========================================\n";
+    status_stream() << "========================================\n";
+    status_stream() << "NU Information Exchange System - Client\n";
+    status_stream() << "Campus: " << campus_name << "\n";
+    status_stream() << "Department: " << department << "\n";
+    status_stream() << "Server: " << server_ip << "\n";
+    status_stream() << "========================================\n";
     
     // TCP Connection
-    tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if(tcp_socket < 0) {
-        perror("TCP socket creation failed");
-        return 1;
-    }
-    
-    sockaddr_in server_addr;
     memset(&server_addr, 0, sizeof(server_addr));
     server_addr.sin_family = AF_INET;
     server_addr.sin_port = htons(TCP_PORT);
     inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr);
     
-    cout << "Connecting to central server...\n";
-    if(connect(tcp_socket, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
-        perror("Connection failed");
-        cleanup();
-        return 1;
-    }
-    
-    // Authentication
-    string auth_data = "Campus:" + campus_name + ",Pass:" + password + ",Dept:" + department + "\n";
-    if(send(tcp_socket, auth_data.c_str(), auth_data.size(), 0) < 0) {
-        perror("Authentication failed");
+    status_stream() << "Connecting to central server...\n";
+    if(connect_to_server(true) != ConnectResult::OK) {
         cleanup();
         return 1;
     }
-    
-    char response[BUFFER_SIZE];
-    ssize_t bytes = recv(tcp_socket, response, BUFFER_SIZE - 1, 0);
-    if(bytes > 0) {
-        response[bytes] = '\0';
-        cout << "Server: " << response << "\n";
-        
-        if(string(response).find("AUTH_FAIL") != string::npos) {
-            cout << "Authentication rejected\n";
-            cleanup();
-            return 1;
-        }
-    }
-    
+    connected = true;
+    next_message_id = mt19937_64(random_device{}())();
+
     // UDP Setup
     udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
     if(udp_socket < 0) {
@@ -250,23 +1130,28 @@ int main(int argc, char* argv[]) {
     thread tcp_receiver(receive_tcp_messages);
     thread udp_receiver(receive_udp_broadcasts);
     thread heartbeat_thread(send_heartbeat, udp_server_addr);
+    thread sender_thread(send_loop);
     
-    cout << "Connected to central server successfully!\n";
-    cout << "Heartbeat service started (60 second intervals)\n";
+    status_stream() << "Connected to central server successfully!\n";
+    status_stream() << "Heartbeat service started (60 second intervals)\n";
+    
+    int exit_code = 0;
+    if(!batch_path.empty()) exit_code = run_batch(batch_path, linger);
     
     // Main interaction loop
-    while(client_running) {
+    while(client_running && batch_path.empty()) {
         display_menu();
         
         string choice;
         if(!getline(cin, choice)) {
+            wait_for_sent();
             client_running = false;
             break;
         }
         
         if(choice == "1") {
             cout << "\n--- Send Message ---\n";
-            cout << "Target Campus (Lahore/Karachi/Peshawar/CFD/Multan): ";
+            cout << "Target Campus (Lahore/Karachi/Peshawar/CFD/Multan, * for all): ";
             string target_campus;
             getline(cin, target_campus);
             
@@ -275,7 +1160,7 @@ int main(int argc, char* argv[]) {
                 continue;
             }
             
-            cout << "Target Department: ";
+            cout << "Target Department (* for all): ";
             string target_dept;
             getline(cin, target_dept);
             
@@ -293,9 +1178,14 @@ int main(int argc, char* argv[]) {
                 continue;
             }
             
-            string packet = "SEND:" + target_campus + ":" + target_dept + ":" + message + "\n";
-            if(send(tcp_socket, packet.c_str(), packet.size(), 0) > 0) {
-                cout << "Message sent to " << target_campus << " (" << target_dept << ")\n";
+            string packet;
+            uint64_t id;
+            if(!encode_send(packet, target_campus, target_dept, message, id)) {
+                cout << "Message too long\n";
+                continue;
+            }
+            if(queue_message(move(packet), id)) {
+                cout << "Message queued for " << target_campus << " (" << target_dept << ")\n";
             } else {
                 cout << "Failed to send message\n";
             }
@@ -304,13 +1194,24 @@ int main(int argc, char* argv[]) {
             cout << "\n--- Connection Status ---\n";
             cout << "Campus: " << campus_name << "\n";
             cout << "Department: " << department << "\n";
-            cout << "TCP Connection: Active\n";
+            cout << "TCP Connection: " << (connected ? "Active" : "Reconnecting") << "\n";
             cout << "UDP Heartbeat: Active\n";
+            {
+                lock_guard<mutex> lock(send_queue.lock);
+                cout << "Send queue: " << send_queue.messages.size() << " waiting, ";
+                if(credit_flow) {
+                    cout << send_queue.in_flight << "/" << send_window << " unacknowledged\n";
+                } else {
+                    cout << "no flow control\n";
+                }
+            }
+            if(server_acks) print_delivery_summary(cout);
             cout << "Server: " << server_ip << "\n";
-            cout << "Status: Connected\n";
+            cout << "Status: " << (connected ? "Connected" : "Reconnecting") << "\n";
         }
         else if(choice == "3") {
             cout << "Disconnecting from server...\n";
+            wait_for_sent();    // Queued messages go out first
             client_running = false;
             break;
         }
@@ -320,8 +1221,8 @@ int main(int argc, char* argv[]) {
             cout << "2. Status - Show connection information\n";
             cout << "3. Exit - Close this client\n";
             cout << "\nMessage Format:\n";
-            cout << "   Target Campus: Lahore, Karachi, etc\n";
-            cout << "   Target Dept: Admissions, Academics, etc\n";
+            cout << "   Target Campus: Lahore, Karachi, etc, or * for every campus\n";
+            cout << "   Target Dept: Admissions, Academics, etc, or * for every department\n";
             cout << "   Message: Any text message\n";
         }
         else {
@@ -335,7 +1236,8 @@ int main(int argc, char* argv[]) {
     if(tcp_receiver.joinable()) tcp_receiver.join();
     if(udp_receiver.joinable()) udp_receiver.join();
     if(heartbeat_thread.joinable()) heartbeat_thread.join();
+    if(sender_thread.joinable()) sender_thread.join();
     
-    cout << campus_name << " campus client stopped.\n";
-    return 0;
+    status_stream() << campus_name << " campus client stopped.\n";
+    return exit_code;
 }
\ No newline at end of file
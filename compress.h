@@ -0,0 +1,97 @@
+// compress.h - Payload compression shared by server.cpp and client.cpp
+// CN Project Fall 2025 - NU Information Exchange System
+//
+// Framed clients that add ",Compress:deflate" to the auth line may send
+// FRAME_SEND payloads as zlib streams, marked with FRAME_FLAG_DEFLATE. The
+// server relays those frames untouched to receivers that negotiated the same
+// and inflates a copy only for the ones that did not.
+//
+// A preset dictionary (a file of typical bulletin text, --compress-dict on
+// both sides) helps the short, repetitive messages most. It is identified by
+// its Adler-32: the server announces ",Dict:<id>" in AUTH_OK, a client whose
+// dictionary has the same id compresses with it and marks those frames
+// FRAME_FLAG_DICTIONARY as well.
+#ifndef NU_COMPRESS_H
+#define NU_COMPRESS_H
+
+#include <zlib.h>           // deflate/inflate
+#include <cstdint>          // Fixed-width integers
+#include <fstream>          // Dictionary files
+#include <sstream>          // Reading a whole file
+#include <string>           // String class
+#include <string_view>      // Payload views
+
+#define COMPRESS_THRESHOLD 256      // Default: smaller payloads are sent as-is
+#define COMPRESS_LEVEL 1            // Fastest; routing messages are latency-bound
+
+// Adler-32 of the dictionary, the id zlib records in streams that use it
+inline uint32_t dictionary_id(const std::string &dictionary) {
+    return (uint32_t)adler32(adler32(0, nullptr, 0), (const Bytef*)dictionary.data(),
+                             (uInt)dictionary.size());
+}
+
+inline bool load_dictionary(const std::string &path, std::string &dictionary) {
+    std::ifstream file(path, std::ios::binary);
+    if(!file) return false;
+    std::ostringstream contents;
+    contents << file.rdbuf();
+    dictionary = contents.str();
+    return !dictionary.empty();
+}
+
+// Replace out with the zlib stream of in. False on failure or when the
+// result would not be smaller than in, in which case in should go as-is.
+inline bool deflate_payload(std::string &out, std::string_view in, const std::string *dictionary) {
+    z_stream stream{};
+    if(deflateInit(&stream, COMPRESS_LEVEL) != Z_OK) return false;
+    if(dictionary != nullptr &&
+       deflateSetDictionary(&stream, (const Bytef*)dictionary->data(), (uInt)dictionary->size()) != Z_OK) {
+        deflateEnd(&stream);
+        return false;
+    }
+
+    out.resize(deflateBound(&stream, in.size()));
+    stream.next_in = (Bytef*)in.data();
+    stream.avail_in = (uInt)in.size();
+    stream.next_out = (Bytef*)&out[0];
+    stream.avail_out = (uInt)out.size();
+    int status = deflate(&stream, Z_FINISH);
+    out.resize(stream.total_out);
+    deflateEnd(&stream);
+    return status == Z_STREAM_END && out.size() < in.size();
+}
+
+// Replace out with the inflated form of in. False for a corrupt stream, one
+// that needs a dictionary other than the one given, or output past limit.
+inline bool inflate_payload(std::string &out, std::string_view in, const std::string *dictionary,
+                            size_t limit) {
+    z_stream stream{};
+    if(inflateInit(&stream) != Z_OK) return false;
+    stream.next_in = (Bytef*)in.data();
+    stream.avail_in = (uInt)in.size();
+
+    out.clear();
+    char chunk[16384];
+    int status = Z_OK;
+    while(status != Z_STREAM_END) {
+        stream.next_out = (Bytef*)chunk;
+        stream.avail_out = sizeof(chunk);
+        status = inflate(&stream, Z_NO_FLUSH);
+        if(status == Z_NEED_DICT && dictionary != nullptr) {
+            status = inflateSetDictionary(&stream, (const Bytef*)dictionary->data(),
+                                          (uInt)dictionary->size());
+            if(status != Z_OK) break;   // Stream was made with another dictionary
+            continue;
+        }
+        if(status != Z_OK && status != Z_STREAM_END) break;
+        out.append(chunk, sizeof(chunk) - stream.avail_out);
+        if(out.size() > limit || (status == Z_OK && stream.avail_in == 0 && stream.avail_out != 0)) {
+            status = Z_DATA_ERROR;  // Too large, or truncated input
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    return status == Z_STREAM_END;
+}
+
+#endif
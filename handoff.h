@@ -0,0 +1,287 @@
+// handoff.h - Passing a running server's sockets to its replacement
+// CN Project Fall 2025 - NU Information Exchange System
+//
+// A server started with --handoff <path> first tries to connect to <path>.
+// If an older server is listening there, the new one sends HANDOFF_REQUEST
+// and the old one stops its event loops and answers, over the same Unix
+// socket, with:
+//
+//   HANDOFF_LISTENERS    the UDP socket and every TCP listener (SCM_RIGHTS)
+//   HANDOFF_CONNECTION   one per campus connection, only if requested: its
+//                        socket plus the state needed to carry on
+//   HANDOFF_DONE         the old server's spool is closed; its next connection
+//                        id and compression dictionary id
+//
+// Every record is a 1-byte type and a 4-byte payload length, then the
+// payload (integers in network byte order, strings length-prefixed). A
+// record's descriptors travel with its first byte.
+//
+// A connection record holds the bytes the old server had read but not
+// parsed and those it had queued but not written, so neither direction of
+// the stream loses or repeats a byte. Output starts at a message boundary;
+// written says how much of it (part of one message) is already on the wire.
+#ifndef NU_HANDOFF_H
+#define NU_HANDOFF_H
+
+#include <sys/socket.h>     // sendmsg, recvmsg, SCM_RIGHTS
+#include <unistd.h>         // close
+#include <endian.h>         // Byte order conversion
+#include <cerrno>           // EINTR
+#include <cstdint>          // Fixed-width integers
+#include <cstring>          // memcpy
+#include <deque>            // Received descriptors, in order
+#include <string>           // Record buffers
+#include <string_view>      // Payload views
+
+#define HANDOFF_MAGIC 0x4E55484Fu      // "NUHO"
+#define HANDOFF_VERSION 1
+#define HANDOFF_RECORD_HEADER 5
+#define HANDOFF_MAX_FDS 64              // Most descriptors in one record
+
+enum HandoffRecordType : uint8_t {
+    HANDOFF_REQUEST = 1,
+    HANDOFF_LISTENERS = 2,
+    HANDOFF_CONNECTION = 3,
+    HANDOFF_DONE = 4
+};
+
+enum HandoffFlag : uint8_t {
+    HANDOFF_WANT_CONNECTIONS = 1    // Pass the campus connections too
+};
+
+// One campus connection as the old server left it
+struct HandoffConnection {
+    int fd = -1;                // Arrives with the record
+    uint64_t conn_id = 0;
+    bool active = false;        // Authenticated; otherwise still waiting for its auth line
+    uint8_t proto = 1;
+    uint16_t frame_flags = 0;
+    uint32_t credit_window = 0;
+    uint32_t uncredited = 0;
+    int32_t campus_id = -1;
+    uint64_t udp_endpoint = 0;
+    int64_t last_seen_ms = 0;   // CLOCK_MONOTONIC is shared by both processes
+    std::string department;
+    std::string input;          // Read, not yet parsed
+    std::string output;         // Queued, from the first message not completely written
+    uint64_t written = 0;       // Bytes of output already written
+};
+
+inline void handoff_put(std::string &out, const void *data, size_t size) {
+    out.append((const char*)data, size);
+}
+
+inline void handoff_put_u32(std::string &out, uint32_t value) {
+    value = htobe32(value);
+    handoff_put(out, &value, 4);
+}
+
+inline void handoff_put_u64(std::string &out, uint64_t value) {
+    value = htobe64(value);
+    handoff_put(out, &value, 8);
+}
+
+inline void handoff_put_string(std::string &out, std::string_view text) {
+    handoff_put_u32(out, (uint32_t)text.size());
+    handoff_put(out, text.data(), text.size());
+}
+
+// Reads fields off the front of a payload; any read past the end fails the whole decode
+struct HandoffCursor {
+    std::string_view rest;
+    bool ok = true;
+
+    const char *take(size_t size) {
+        if(!ok || rest.size() < size) {
+            ok = false;
+            return nullptr;
+        }
+        const char *data = rest.data();
+        rest.remove_prefix(size);
+        return data;
+    }
+    uint8_t u8() {
+        const char *data = take(1);
+        return data ? (uint8_t)data[0] : 0;
+    }
+    uint32_t u32() {
+        uint32_t value = 0;
+        if(const char *data = take(4)) memcpy(&value, data, 4);
+        return be32toh(value);
+    }
+    uint64_t u64() {
+        uint64_t value = 0;
+        if(const char *data = take(8)) memcpy(&value, data, 8);
+        return be64toh(value);
+    }
+    std::string text() {
+        uint32_t size = u32();
+        const char *data = take(size);
+        return data ? std::string(data, size) : std::string();
+    }
+};
+
+inline void begin_handoff_record(std::string &out, uint8_t type) {
+    out.clear();
+    out += (char)type;
+    handoff_put_u32(out, 0);    // Patched by finish_handoff_record
+}
+
+inline void finish_handoff_record(std::string &out) {
+    uint32_t length = htobe32((uint32_t)(out.size() - HANDOFF_RECORD_HEADER));
+    memcpy(&out[1], &length, 4);
+}
+
+inline void encode_handoff_request(std::string &out, uint8_t flags) {
+    begin_handoff_record(out, HANDOFF_REQUEST);
+    handoff_put_u32(out, HANDOFF_MAGIC);
+    out += (char)HANDOFF_VERSION;
+    out += (char)flags;
+    finish_handoff_record(out);
+}
+
+inline bool decode_handoff_request(std::string_view payload, uint8_t &flags) {
+    HandoffCursor cursor{payload};
+    bool matches = cursor.u32() == HANDOFF_MAGIC && cursor.u8() == HANDOFF_VERSION;
+    flags = cursor.u8();
+    return cursor.ok && matches;
+}
+
+inline void encode_handoff_connection(std::string &out, const HandoffConnection &conn) {
+    begin_handoff_record(out, HANDOFF_CONNECTION);
+    handoff_put_u64(out, conn.conn_id);
+    out += (char)conn.active;
+    out += (char)conn.proto;
+    handoff_put_u32(out, conn.frame_flags);
+    handoff_put_u32(out, conn.credit_window);
+    handoff_put_u32(out, conn.uncredited);
+    handoff_put_u32(out, (uint32_t)conn.campus_id);
+    handoff_put_u64(out, conn.udp_endpoint);
+    handoff_put_u64(out, (uint64_t)conn.last_seen_ms);
+    handoff_put_string(out, conn.department);
+    handoff_put_string(out, conn.input);
+    handoff_put_string(out, conn.output);
+    handoff_put_u64(out, conn.written);
+    finish_handoff_record(out);
+}
+
+// Everything but fd
+inline bool decode_handoff_connection(std::string_view payload, HandoffConnection &conn) {
+    HandoffCursor cursor{payload};
+    conn.conn_id = cursor.u64();
+    conn.active = cursor.u8() != 0;
+    conn.proto = cursor.u8();
+    conn.frame_flags = (uint16_t)cursor.u32();
+    conn.credit_window = cursor.u32();
+    conn.uncredited = cursor.u32();
+    conn.campus_id = (int32_t)cursor.u32();
+    conn.udp_endpoint = cursor.u64();
+    conn.last_seen_ms = (int64_t)cursor.u64();
+    conn.department = cursor.text();
+    conn.input = cursor.text();
+    conn.output = cursor.text();
+    conn.written = cursor.u64();
+    return cursor.ok && conn.written <= conn.output.size();
+}
+
+// Write a whole record on a blocking socket, the descriptors with its first byte
+inline bool send_handoff_record(int sock, const std::string &record, const int *fds = nullptr,
+                                size_t fd_count = 0) {
+    if(fd_count > HANDOFF_MAX_FDS) return false;
+    size_t offset = 0;
+    while(offset < record.size()) {
+        iovec part{(void*)(record.data() + offset), record.size() - offset};
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        if(offset == 0 && fd_count > 0) {
+            message.msg_control = control;
+            message.msg_controllen = CMSG_SPACE(sizeof(int) * fd_count);
+            cmsghdr *header = CMSG_FIRSTHDR(&message);
+            header->cmsg_level = SOL_SOCKET;
+            header->cmsg_type = SCM_RIGHTS;
+            header->cmsg_len = CMSG_LEN(sizeof(int) * fd_count);
+            memcpy(CMSG_DATA(header), fds, sizeof(int) * fd_count);
+        }
+        ssize_t sent = sendmsg(sock, &message, MSG_NOSIGNAL);
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent <= 0) return false;
+        offset += sent;
+    }
+    return true;
+}
+
+// Receiving end: reassembles records and collects the descriptors that
+// arrive with them, in order. Descriptors nobody took are closed.
+class HandoffReader {
+public:
+    explicit HandoffReader(int sock) : sock(sock) {}
+    HandoffReader(const HandoffReader&) = delete;
+    HandoffReader &operator=(const HandoffReader&) = delete;
+    ~HandoffReader() {
+        for(int fd : fds) close(fd);
+    }
+
+    // Block until a whole record is in; false on EOF, error or timeout
+    bool read_record(uint8_t &type, std::string &payload) {
+        while(true) {
+            if(buffer.size() >= HANDOFF_RECORD_HEADER) {
+                uint32_t length;
+                memcpy(&length, buffer.data() + 1, 4);
+                length = be32toh(length);
+                if(buffer.size() - HANDOFF_RECORD_HEADER >= length) {
+                    type = (uint8_t)buffer[0];
+                    payload.assign(buffer, HANDOFF_RECORD_HEADER, length);
+                    buffer.erase(0, HANDOFF_RECORD_HEADER + length);
+                    return true;
+                }
+            }
+            if(!fill()) return false;
+        }
+    }
+
+    // Next descriptor received, or -1; the caller owns it
+    int take_fd() {
+        if(fds.empty()) return -1;
+        int fd = fds.front();
+        fds.pop_front();
+        return fd;
+    }
+
+private:
+    bool fill() {
+        char data[64 * 1024];
+        iovec part{data, sizeof(data)};
+        alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int) * HANDOFF_MAX_FDS)];
+        msghdr message{};
+        message.msg_iov = &part;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        ssize_t received;
+        do {
+            received = recvmsg(sock, &message, MSG_CMSG_CLOEXEC);
+        } while(received < 0 && errno == EINTR);
+        bool truncated = received > 0 && (message.msg_flags & MSG_CTRUNC);     // Out of descriptors
+        for(cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+            header = CMSG_NXTHDR(&message, header)) {
+            if(header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) continue;
+            size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+            for(size_t i = 0; i < count; i++) {
+                int fd;
+                memcpy(&fd, CMSG_DATA(header) + i * sizeof(int), sizeof(int));
+                fds.push_back(fd);
+            }
+        }
+        if(received <= 0 || truncated) return false;
+        buffer.append(data, received);
+        return true;
+    }
+
+    int sock;
+    std::string buffer;
+    std::deque<int> fds;
+};
+
+#endif
@@ -0,0 +1,496 @@
+// loadgen.cpp Headless load generator for the central server
+// Usage: ./loadgen [--server IP] [--connections N] [--rate MSGS_PER_SEC] ...
+// Example: ./loadgen --connections 2000 --rate 20000 --duration 30 --size 64:1024
+//
+// Opens many framed campus connections with synthetic departments, sends
+// messages between them at a fixed total rate and measures how long each one
+// takes to come back out of the server. Sender and receiver are both in this
+// process, so latency is end to end on one monotonic clock. Broadcasts typed
+// at the server console during a run are counted as they arrive.
+
+// Network communication headers
+#include <arpa/inet.h>      // IP address conversion functions
+#include <netinet/in.h>     // Internet address structures
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <sys/epoll.h>      // Event loop per thread
+#include <sys/resource.h>   // File descriptor limit
+#include <sys/socket.h>     // Socket creation and operations
+#include <fcntl.h>          // Nonblocking sockets
+#include <unistd.h>         // POSIX API (close, read, write)
+// Standard C++ headers
+#include <algorithm>        // min, max
+#include <atomic>           // Run-wide counters
+#include <cerrno>           // Error number definitions
+#include <chrono>           // Monotonic clock
+#include <cmath>            // Percentile ranks
+#include <cstdio>           // Report formatting
+#include <cstring>          // C string functions
+#include <iostream>         // Console output
+#include <random>           // Targets and sizes
+#include <signal.h>         // Signal handling (Ctrl+C)
+#include <string>           // String manipulation
+#include <thread>           // Load threads
+#include <unordered_map>    // Broadcast tallies
+#include <vector>           // Connection lists
+// Project headers
+#include "protocol.h"       // Framed wire protocol
+
+using namespace std;
+
+const int TCP_PORT = 54000;
+const int UDP_PORT = 54001;
+const int BUFFER_SIZE = 65536;
+const size_t MAX_BACKLOG = 1024 * 1024;    // Per connection; more is skipped, not queued
+
+// Synthetic credentials: the server's campuses, each with many departments
+const pair<const char*, const char*> CAMPUSES[] = {
+    {"Lahore", "NU-LHR-123"},
+    {"Karachi", "NU-KHI-123"},
+    {"Peshawar", "NU-PEW-123"},
+    {"CFD", "NU-CFD-123"},
+    {"Multan", "NU-MLT-123"}
+};
+
+string server_ip = "127.0.0.1";
+int connection_count = 100;
+int thread_count = 0;           // 0 = min(4, hardware threads)
+double total_rate = 1000;       // Messages per second across all connections
+int duration_seconds = 10;
+int drain_seconds = 2;          // How long to wait for stragglers after sending stops
+size_t min_size = 64, max_size = 64;
+int heartbeat_interval = 60;
+
+atomic<bool> running{true};
+atomic<bool> sending{true};
+atomic<uint64_t> total_sent{0};
+atomic<uint64_t> total_received{0};
+
+void signal_handler(int) {
+    sending = false;
+    running = false;
+}
+
+int64_t monotonic_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// Log-linear histogram of microseconds: values below 32 get a bucket each,
+// larger ones one of 32 sub-buckets of their power of two, so a reported
+// percentile is within about 3% of the true value
+struct LatencyHistogram {
+    static const int SUB_BUCKETS = 32;
+    vector<uint64_t> counts = vector<uint64_t>(64 * SUB_BUCKETS, 0);
+    uint64_t total = 0;
+    uint64_t max_value = 0;
+
+    static size_t bucket(uint64_t value) {
+        if(value < SUB_BUCKETS) return value;
+        int shift = 63 - __builtin_clzll(value) - 5;
+        return SUB_BUCKETS * (shift + 1) + ((value >> shift) - SUB_BUCKETS);
+    }
+
+    // Midpoint of the values that land in bucket index
+    static uint64_t bucket_value(size_t index) {
+        if(index < SUB_BUCKETS) return index;
+        int shift = (int)(index / SUB_BUCKETS) - 1;
+        uint64_t low = (uint64_t)(SUB_BUCKETS + index % SUB_BUCKETS) << shift;
+        return low + ((1ull << shift) - 1) / 2;
+    }
+
+    void record(uint64_t value) {
+        counts[bucket(value)]++;
+        total++;
+        max_value = max(max_value, value);
+    }
+
+    void merge(const LatencyHistogram &other) {
+        for(size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+        total += other.total;
+        max_value = max(max_value, other.max_value);
+    }
+
+    uint64_t percentile(double fraction) const {
+        uint64_t rank = (uint64_t)ceil(fraction * total);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if(seen >= rank && counts[i] > 0) return min(bucket_value(i), max_value);
+        }
+        return max_value;
+    }
+};
+
+// One simulated campus terminal
+struct SimConnection {
+    int index = 0;
+    int tcp_socket = -1;
+    int udp_socket = -1;
+    string campus;
+    string department;
+    int campus_id = -1;
+    uint64_t conn_id = 0;
+    string in_buf;          // Reassembly buffer for frames
+    string out_buf;         // Encoded frames the socket has not taken yet
+    uint32_t heartbeat_sequence = 0;
+    int64_t next_heartbeat_ns = 0;
+    bool lost = false;
+};
+
+// A thread's share of the connections and everything it measured
+struct LoadThread {
+    vector<SimConnection*> connections;
+    int epoll_fd = -1;
+    double rate = 0;            // This thread's share of total_rate
+    mt19937_64 rng;
+    LatencyHistogram latency;
+    uint64_t sent = 0;
+    uint64_t received = 0;
+    uint64_t skipped = 0;       // Not sent because the connection's backlog was full
+    uint64_t heartbeats = 0;
+    uint64_t lost = 0;
+    unordered_map<string, uint64_t> broadcasts;     // Datagram text -> connections reached
+};
+
+vector<SimConnection> connections;
+sockaddr_in server_udp_addr;
+
+// Write as much of out_buf as the socket takes; false if the connection died
+bool flush_output(SimConnection &conn) {
+    while(!conn.out_buf.empty()) {
+        ssize_t written = send(conn.tcp_socket, conn.out_buf.data(), conn.out_buf.size(), MSG_NOSIGNAL);
+        if(written > 0) {
+            conn.out_buf.erase(0, written);
+            continue;
+        }
+        if(written < 0 && errno == EINTR) continue;
+        return written < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+    }
+    return true;
+}
+
+void mark_lost(LoadThread &self, SimConnection &conn) {
+    if(conn.lost) return;
+    conn.lost = true;
+    self.lost++;
+    epoll_ctl(self.epoll_fd, EPOLL_CTL_DEL, conn.tcp_socket, nullptr);
+}
+
+// Payload: "LG <send time ns> " padded to a size drawn from [min_size, max_size]
+void send_message(LoadThread &self, SimConnection &conn) {
+    if(conn.out_buf.size() > MAX_BACKLOG) {
+        self.skipped++;
+        return;
+    }
+    const SimConnection *target = &connections[self.rng() % connections.size()];
+    if(target == &conn) target = &connections[(conn.index + 1) % connections.size()];
+
+    size_t size = min_size + (max_size > min_size ? self.rng() % (max_size - min_size + 1) : 0);
+    string payload = "LG " + to_string(monotonic_ns()) + " ";
+    if(payload.size() < size) payload.append(size - payload.size(), 'x');
+
+    encode_frame(conn.out_buf, FRAME_SEND, target->campus, target->department, payload);
+    self.sent++;
+    total_sent.fetch_add(1, memory_order_relaxed);
+    if(!flush_output(conn)) mark_lost(self, conn);
+}
+
+void send_heartbeat(LoadThread &self, SimConnection &conn) {
+    HeartbeatPacket packet;
+    packet.campus_id = (uint16_t)conn.campus_id;
+    packet.conn_id = conn.conn_id;
+    packet.sequence = conn.heartbeat_sequence++;
+    packet.sent_ns = monotonic_ns();
+    char heartbeat[HEARTBEAT_PACKET_SIZE];
+    encode_heartbeat(heartbeat, packet);
+    sendto(conn.udp_socket, heartbeat, sizeof(heartbeat), 0,
+           (sockaddr*)&server_udp_addr, sizeof(server_udp_addr));
+    self.heartbeats++;
+}
+
+void receive_tcp(LoadThread &self, SimConnection &conn) {
+    char buffer[BUFFER_SIZE];
+    while(true) {
+        ssize_t bytes = recv(conn.tcp_socket, buffer, sizeof(buffer), 0);
+        if(bytes > 0) {
+            conn.in_buf.append(buffer, bytes);
+            continue;
+        }
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) mark_lost(self, conn);
+        break;
+    }
+
+    int64_t now = monotonic_ns();
+    size_t consumed = 0;
+    while(true) {
+        FrameView frame;
+        size_t frame_size = 0;
+        FrameStatus status = decode_frame(conn.in_buf.data() + consumed, conn.in_buf.size() - consumed,
+                                          frame, frame_size);
+        if(status == FrameStatus::INCOMPLETE) break;
+        if(status == FrameStatus::INVALID) {
+            mark_lost(self, conn);
+            break;
+        }
+        consumed += frame_size;
+        if(frame.type != FRAME_DELIVER || frame.payload.substr(0, 3) != "LG ") continue;
+
+        int64_t sent_ns = strtoll(string(frame.payload.substr(3, 24)).c_str(), nullptr, 10);
+        self.latency.record((uint64_t)max<int64_t>(0, now - sent_ns) / 1000);
+        self.received++;
+        total_received.fetch_add(1, memory_order_relaxed);
+    }
+    conn.in_buf.erase(0, consumed);
+}
+
+void receive_udp(LoadThread &self, SimConnection &conn) {
+    char buffer[BUFFER_SIZE];
+    while(true) {
+        ssize_t bytes = recv(conn.udp_socket, buffer, sizeof(buffer), 0);
+        if(bytes < 0 && errno == EINTR) continue;
+        if(bytes < 0) break;
+        self.broadcasts[string(buffer, bytes)]++;
+    }
+}
+
+// Event data: connection index * 2, plus 1 for its UDP socket
+void load_loop(LoadThread *self) {
+    epoll_event events[256];
+    int64_t start_ns = monotonic_ns();
+    int64_t stop_sending_ns = start_ns + (int64_t)duration_seconds * 1000000000;
+    int64_t stop_ns = stop_sending_ns + (int64_t)drain_seconds * 1000000000;
+    size_t next_sender = 0;
+
+    while(running) {
+        int64_t now = monotonic_ns();
+        if(now >= stop_sending_ns) sending = false;
+        if(now >= stop_ns || (!sending && total_received.load() >= total_sent.load())) break;
+
+        // Catch up to the configured rate, spreading sends over connections
+        if(sending && !self->connections.empty()) {
+            uint64_t due = (uint64_t)(self->rate * (now - start_ns) / 1e9);
+            for(size_t attempts = 0; self->sent + self->skipped < due && attempts < self->connections.size() * 4;) {
+                SimConnection &conn = *self->connections[next_sender++ % self->connections.size()];
+                if(conn.lost) {
+                    attempts++;
+                    continue;
+                }
+                send_message(*self, conn);
+            }
+        }
+        for(SimConnection *conn : self->connections) {
+            if(!conn->lost && now >= conn->next_heartbeat_ns) {
+                send_heartbeat(*self, *conn);
+                conn->next_heartbeat_ns += (int64_t)heartbeat_interval * 1000000000;
+            }
+        }
+
+        int ready = epoll_wait(self->epoll_fd, events, 256, 1);
+        for(int i = 0; i < ready; i++) {
+            SimConnection &conn = connections[events[i].data.u64 / 2];
+            if(events[i].data.u64 % 2 == 1) {
+                receive_udp(*self, conn);
+                continue;
+            }
+            if(events[i].events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) receive_tcp(*self, conn);
+            if(!conn.lost && (events[i].events & EPOLLOUT) && !flush_output(conn)) mark_lost(*self, conn);
+        }
+    }
+}
+
+// Blocking connect and auth; the socket is made nonblocking afterwards
+bool open_connection(SimConnection &conn, const sockaddr_in &server_addr) {
+    const auto &campus = CAMPUSES[conn.index % 5];
+    conn.campus = campus.first;
+    conn.department = "Load" + to_string(conn.index);
+
+    conn.tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(conn.tcp_socket < 0 || connect(conn.tcp_socket, (sockaddr*)&server_addr, sizeof(server_addr)) < 0) {
+        return false;
+    }
+    int nodelay = 1;
+    setsockopt(conn.tcp_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+    string auth_data = "Campus:" + conn.campus + ",Pass:" + campus.second + ",Dept:" + conn.department +
+                       ",Proto:" + to_string(PROTO_VERSION) + "\n";
+    if(send(conn.tcp_socket, auth_data.data(), auth_data.size(), MSG_NOSIGNAL) < 0) return false;
+
+    // The reply is one text line; frames may follow it in the same read
+    char buffer[512];
+    size_t line_end = string::npos;
+    while(line_end == string::npos) {
+        ssize_t bytes = recv(conn.tcp_socket, buffer, sizeof(buffer), 0);
+        if(bytes <= 0) return false;
+        conn.in_buf.append(buffer, bytes);
+        line_end = conn.in_buf.find('\n');
+    }
+    string reply = conn.in_buf.substr(0, line_end);
+    conn.in_buf.erase(0, line_end + 1);
+    if(reply.rfind("AUTH_OK", 0) != 0) return false;
+
+    size_t id = reply.find(",Id:"), conn_field = reply.find(",Conn:");
+    if(id == string::npos || conn_field == string::npos) return false;
+    conn.campus_id = atoi(reply.c_str() + id + 4);
+    conn.conn_id = strtoull(reply.c_str() + conn_field + 6, nullptr, 10);
+
+    conn.udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    if(conn.udp_socket < 0) return false;
+    fcntl(conn.tcp_socket, F_SETFL, fcntl(conn.tcp_socket, F_GETFL) | O_NONBLOCK);
+    fcntl(conn.udp_socket, F_SETFL, fcntl(conn.udp_socket, F_GETFL) | O_NONBLOCK);
+    return true;
+}
+
+void print_usage(const char *program) {
+    cout << "Usage: " << program << " [--server IP] [--connections N] [--threads N]"
+         << " [--rate MSGS_PER_SEC] [--duration SECONDS] [--size MIN[:MAX]]"
+         << " [--heartbeat-interval SECONDS] [--drain SECONDS]\n";
+}
+
+int main(int argc, char* argv[]) {
+    signal(SIGINT, signal_handler);
+    signal(SIGPIPE, SIG_IGN);
+
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--server" && i + 1 < argc) {
+            server_ip = argv[++i];
+        } else if(arg == "--connections" && i + 1 < argc) {
+            connection_count = atoi(argv[++i]);
+        } else if(arg == "--threads" && i + 1 < argc) {
+            thread_count = atoi(argv[++i]);
+        } else if(arg == "--rate" && i + 1 < argc) {
+            total_rate = atof(argv[++i]);
+        } else if(arg == "--duration" && i + 1 < argc) {
+            duration_seconds = atoi(argv[++i]);
+        } else if(arg == "--drain" && i + 1 < argc) {
+            drain_seconds = atoi(argv[++i]);
+        } else if(arg == "--size" && i + 1 < argc) {
+            string sizes = argv[++i];
+            size_t colon = sizes.find(':');
+            min_size = stoul(sizes.substr(0, colon));
+            max_size = colon == string::npos ? min_size : stoul(sizes.substr(colon + 1));
+        } else if(arg == "--heartbeat-interval" && i + 1 < argc) {
+            heartbeat_interval = atoi(argv[++i]);
+        } else {
+            print_usage(argv[0]);
+            return 1;
+        }
+    }
+    if(connection_count < 2 || total_rate <= 0 || duration_seconds < 1 || heartbeat_interval < 1 ||
+       max_size < min_size || max_size > MAX_PAYLOAD_SIZE) {
+        print_usage(argv[0]);
+        return 1;
+    }
+    if(thread_count <= 0) thread_count = (int)min(4u, max(1u, thread::hardware_concurrency()));
+    thread_count = min(thread_count, connection_count);
+
+    // Two sockets per connection
+    rlimit limit;
+    if(getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    sockaddr_in server_addr;
+    memset(&server_addr, 0, sizeof(server_addr));
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(TCP_PORT);
+    if(inet_pton(AF_INET, server_ip.c_str(), &server_addr.sin_addr) != 1) {
+        cout << "Invalid server address: " << server_ip << "\n";
+        return 1;
+    }
+    server_udp_addr = server_addr;
+    server_udp_addr.sin_port = htons(UDP_PORT);
+
+    cout << "Opening " << connection_count << " connections to " << server_ip << "...\n";
+    connections.resize(connection_count);
+    int64_t connect_start = monotonic_ns();
+    for(int i = 0; i < connection_count && running; i++) {
+        connections[i].index = i;
+        errno = 0;
+        if(!open_connection(connections[i], server_addr)) {
+            cout << "Connection " << i << " failed: " << (errno ? strerror(errno) : "authentication rejected") << "\n";
+            return 1;
+        }
+    }
+    double connect_seconds = (monotonic_ns() - connect_start) / 1e9;
+
+    // Deal connections out to threads. First heartbeats (which tell the server
+    // where to send broadcasts) are spread over the first second rather than
+    // sent in one burst the server's UDP buffer would partly drop.
+    vector<LoadThread> threads(thread_count);
+    int64_t now = monotonic_ns();
+    for(int t = 0; t < thread_count; t++) {
+        threads[t].epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        threads[t].rate = total_rate / thread_count;
+        threads[t].rng.seed(t + 1);
+    }
+    for(auto &conn : connections) {
+        LoadThread &owner = threads[conn.index % thread_count];
+        owner.connections.push_back(&conn);
+        conn.next_heartbeat_ns = now + 1000000000ll * conn.index / connection_count;
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.u64 = (uint64_t)conn.index * 2;
+        epoll_ctl(owner.epoll_fd, EPOLL_CTL_ADD, conn.tcp_socket, &ev);
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = (uint64_t)conn.index * 2 + 1;
+        epoll_ctl(owner.epoll_fd, EPOLL_CTL_ADD, conn.udp_socket, &ev);
+    }
+
+    cout << "Connected in " << connect_seconds << " s; sending " << total_rate << " msg/s for "
+         << duration_seconds << " s on " << thread_count << " thread" << (thread_count > 1 ? "s" : "") << "\n";
+    int64_t run_start = monotonic_ns();
+    vector<thread> workers;
+    for(auto &load_thread : threads) workers.emplace_back(load_loop, &load_thread);
+    for(auto &worker : workers) worker.join();
+    double elapsed = (monotonic_ns() - run_start) / 1e9;
+
+    // Merge per-thread results
+    LatencyHistogram latency;
+    uint64_t sent = 0, received = 0, skipped = 0, heartbeats = 0, lost = 0;
+    unordered_map<string, uint64_t> broadcasts;
+    for(auto &load_thread : threads) {
+        latency.merge(load_thread.latency);
+        sent += load_thread.sent;
+        received += load_thread.received;
+        skipped += load_thread.skipped;
+        heartbeats += load_thread.heartbeats;
+        lost += load_thread.lost;
+        for(auto &broadcast : load_thread.broadcasts) broadcasts[broadcast.first] += broadcast.second;
+        close(load_thread.epoll_fd);
+    }
+    double send_seconds = min<double>(elapsed, duration_seconds);
+
+    printf("\n========================================\n");
+    printf("Load test report\n");
+    printf("========================================\n");
+    printf("Connections:     %d (%llu lost during the run)\n", connection_count, (unsigned long long)lost);
+    printf("Messages sent:   %llu (%.1f msg/s), %llu skipped on full backlogs\n",
+           (unsigned long long)sent, sent / send_seconds, (unsigned long long)skipped);
+    printf("Messages routed: %llu (%.1f msg/s), %llu undelivered\n",
+           (unsigned long long)received, received / elapsed, (unsigned long long)(sent - min(sent, received)));
+    if(latency.total > 0) {
+        printf("Latency (us):    p50 %llu  p99 %llu  p999 %llu  max %llu\n",
+               (unsigned long long)latency.percentile(0.50), (unsigned long long)latency.percentile(0.99),
+               (unsigned long long)latency.percentile(0.999), (unsigned long long)latency.max_value);
+    }
+    printf("Heartbeats sent: %llu (%.1f/s)\n", (unsigned long long)heartbeats, heartbeats / elapsed);
+    if(broadcasts.empty()) {
+        printf("Broadcasts:      none seen (type broadcast:<text> at the server during a run)\n");
+    }
+    for(auto &broadcast : broadcasts) {
+        printf("Broadcast:       %.1f%% of connections (%llu/%d) got \"%.40s\"\n",
+               100.0 * broadcast.second / connection_count, (unsigned long long)broadcast.second,
+               connection_count, broadcast.first.c_str());
+    }
+    printf("========================================\n");
+
+    for(auto &conn : connections) {
+        close(conn.tcp_socket);
+        close(conn.udp_socket);
+    }
+    return 0;
+}
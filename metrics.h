@@ -0,0 +1,148 @@
+// metrics.h - Counters and latency histograms behind server.cpp's metrics
+// CN Project Fall 2025 - NU Information Exchange System
+//
+// Every thread that records owns its own instruments, so the hot path is a
+// relaxed load and store with no locked instruction and no shared cache line.
+// Readers (the admin console, the scrape endpoint) add up all threads' sets
+// whenever they are asked; a reading may be a few increments behind.
+//
+// Histograms are HDR-style: each power of two is split into
+// HISTOGRAM_SUB_BUCKETS linear buckets, so any recorded duration is known to
+// about 3% whatever its magnitude, in a fixed 9 KB per histogram.
+#ifndef NU_METRICS_H
+#define NU_METRICS_H
+
+#include <algorithm>        // min, max
+#include <atomic>           // Single-writer instruments
+#include <cmath>            // ceil
+#include <cstdint>          // Fixed-width integers
+#include <cstdio>           // snprintf
+#include <string>           // Exposition text
+#include <vector>           // Snapshot buckets
+
+#define HISTOGRAM_SUB_BUCKETS 32    // Linear buckets per power of two
+#define HISTOGRAM_MAGNITUDES 40     // Durations up to 2^40 ns, about 18 minutes
+#define HISTOGRAM_BUCKETS (HISTOGRAM_SUB_BUCKETS * (HISTOGRAM_MAGNITUDES - 4))
+
+// Written by one thread only
+struct MetricCounter {
+    std::atomic<uint64_t> value{0};
+
+    void add(uint64_t amount = 1) {
+        value.store(value.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+    uint64_t get() const { return value.load(std::memory_order_relaxed); }
+};
+
+// Nanosecond durations, written by one thread only
+struct LatencyHistogram {
+    std::atomic<uint64_t> counts[HISTOGRAM_BUCKETS] = {};
+    MetricCounter sum;          // Nanoseconds
+    std::atomic<uint64_t> max_value{0};
+
+    static size_t bucket(uint64_t value) {
+        if(value < HISTOGRAM_SUB_BUCKETS) return value;
+        if(value >> HISTOGRAM_MAGNITUDES) return HISTOGRAM_BUCKETS - 1;
+        int shift = 63 - __builtin_clzll(value) - 5;
+        return HISTOGRAM_SUB_BUCKETS * (shift + 1) + ((value >> shift) - HISTOGRAM_SUB_BUCKETS);
+    }
+
+    // Largest value that lands in bucket index
+    static uint64_t bucket_limit(size_t index) {
+        if(index < HISTOGRAM_SUB_BUCKETS) return index;
+        int shift = (int)(index / HISTOGRAM_SUB_BUCKETS) - 1;
+        uint64_t low = (uint64_t)(HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS) << shift;
+        return low + (1ull << shift) - 1;
+    }
+
+    void record(int64_t nanoseconds) {
+        uint64_t value = nanoseconds > 0 ? (uint64_t)nanoseconds : 0;
+        std::atomic<uint64_t> &slot = counts[bucket(value)];
+        slot.store(slot.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        sum.add(value);
+        if(value > max_value.load(std::memory_order_relaxed)) max_value.store(value, std::memory_order_relaxed);
+    }
+};
+
+// The sum of any number of histograms at one moment, for reporting
+struct HistogramSnapshot {
+    std::vector<uint64_t> counts = std::vector<uint64_t>(HISTOGRAM_BUCKETS, 0);
+    uint64_t count = 0;         // Sum of counts
+    uint64_t sum = 0;
+    uint64_t max_value = 0;
+
+    void add(const LatencyHistogram &histogram) {
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            uint64_t bucket_count = histogram.counts[i].load(std::memory_order_relaxed);
+            counts[i] += bucket_count;
+            count += bucket_count;
+        }
+        sum += histogram.sum.get();
+        max_value = std::max(max_value, histogram.max_value.load(std::memory_order_relaxed));
+    }
+
+    // Nanoseconds; 0 when empty
+    uint64_t percentile(double fraction) const {
+        uint64_t rank = (uint64_t)std::ceil(fraction * count);
+        uint64_t seen = 0;
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS; i++) {
+            seen += counts[i];
+            if(seen >= rank && counts[i] > 0) return std::min(LatencyHistogram::bucket_limit(i), max_value);
+        }
+        return max_value;
+    }
+
+    // Recorded values known to be at most limit nanoseconds
+    uint64_t count_at_most(uint64_t limit) const {
+        uint64_t total = 0;
+        for(size_t i = 0; i < HISTOGRAM_BUCKETS && LatencyHistogram::bucket_limit(i) <= limit; i++) {
+            total += counts[i];
+        }
+        return total;
+    }
+};
+
+// Prometheus text exposition (format 0.0.4). labels is "" or `key="value"`.
+
+inline void append_metric_header(std::string &out, const char *name, const char *type, const char *help) {
+    out += "# HELP ";
+    out += name;
+    out += ' ';
+    out += help;
+    out += "\n# TYPE ";
+    out += name;
+    out += ' ';
+    out += type;
+    out += '\n';
+}
+
+inline void append_metric_sample(std::string &out, const char *name, const std::string &labels, double value,
+                                 const char *suffix = "") {
+    char number[32];
+    snprintf(number, sizeof(number), "%.15g", value);
+    out += name;
+    out += suffix;
+    if(!labels.empty()) out += "{" + labels + "}";
+    out += ' ';
+    out += number;
+    out += '\n';
+}
+
+// Durations exported in seconds, with fixed le bounds from 1 us to 10 s
+inline void append_histogram_samples(std::string &out, const char *name, const std::string &labels,
+                                     const HistogramSnapshot &snapshot) {
+    static const double bounds[] = {1e-6, 5e-6, 1e-5, 5e-5, 1e-4, 5e-4, 1e-3, 5e-3,
+                                    1e-2, 5e-2, 0.1, 0.5, 1, 5, 10};
+    std::string prefix = labels.empty() ? "" : labels + ",";
+    char bound[32];
+    for(double limit : bounds) {
+        snprintf(bound, sizeof(bound), "%g", limit);
+        append_metric_sample(out, name, prefix + "le=\"" + bound + "\"",
+                             (double)snapshot.count_at_most((uint64_t)(limit * 1e9)), "_bucket");
+    }
+    append_metric_sample(out, name, prefix + "le=\"+Inf\"", (double)snapshot.count, "_bucket");
+    append_metric_sample(out, name, labels, snapshot.sum / 1e9, "_sum");
+    append_metric_sample(out, name, labels, (double)snapshot.count, "_count");
+}
+
+#endif
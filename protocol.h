@@ -0,0 +1,280 @@
+// protocol.h - Framed wire protocol shared by server.cpp and client.cpp
+// CN Project Fall 2025 - NU Information Exchange System
+//
+// A client asks for framing by appending ",Proto:2" to the text auth line.
+// If the server answers "AUTH_OK:<campus>,Proto:2" every later TCP message,
+// in both directions, is one frame (all integers in network byte order):
+//
+//   offset  size  field
+//   0       4     total frame length, header included
+//   4       1     protocol version (PROTO_VERSION)
+//   5       1     frame type (FrameType)
+//   6       2     flags (FrameFlag)
+//   8       1     campus name length
+//   9       1     department name length
+//   10      2     reserved, zero
+//   12      ...   campus name, department name, payload
+//
+// For FRAME_SEND the campus/department name the target; for FRAME_DELIVER
+// they name the source. Clients that never send Proto keep the old
+// newline-terminated text protocol. Flags describe the payload encoding
+// (see compress.h) and are relayed with it.
+//
+// A framed client may also ask for flow control with ",Window:<n>". The
+// server echoes the window it grants and then sends FRAME_CREDIT frames whose
+// payload is a 4-byte count of FRAME_SEND frames it has finished routing; the
+// client keeps at most the window's worth of frames unacknowledged.
+//
+// With ",Ack:1" (echoed when granted) a client may mark FRAME_SEND frames
+// FRAME_FLAG_ID: the payload then starts with an 8-byte message id, unique
+// per sender, ahead of the (possibly compressed) body. Receivers that also
+// asked for acks get the id with the message and answer FRAME_ACK, naming
+// the message's source, with the id and an AckStatus; the server passes it
+// on to the ack-capable terminals of that department, naming the receiver
+// instead. The server answers for messages it spooled, could not route or
+// handed to receivers that do not acknowledge. Retried messages keep their
+// id so receivers can drop duplicates. ACK_SPOOLED is sent as soon as the
+// message is in the spool's mapping, before the group commit syncs it (at
+// most about 50 ms later): a power loss or kernel crash in between can
+// still lose it, though the server process dying cannot.
+//
+// The server bounds what it queues for each receiver. When a sender's message
+// meets a full queue the server sends it FRAME_THROTTLE, naming the slow
+// receiver, with a 1-byte ThrottleAction saying what it did about it (at
+// most one a second per sender). Text clients get the line
+// "THROTTLED:<campus>:<department>:<action name>" instead.
+//
+// Framed clients also learn ",Id:<campus id>,Conn:<connection id>" from
+// AUTH_OK and send binary UDP heartbeats instead of "HEARTBEAT:<campus>":
+//
+//   offset  size  field
+//   0       4     HEARTBEAT_MAGIC
+//   4       1     HEARTBEAT_VERSION
+//   5       1     flags (reserved, zero)
+//   6       2     campus id
+//   8       8     connection id
+//   16      4     sequence number
+//   20      8     sender's monotonic clock, nanoseconds
+#ifndef NU_PROTOCOL_H
+#define NU_PROTOCOL_H
+
+#include <arpa/inet.h>      // Byte order conversion
+#include <cstdint>          // Fixed-width integers
+#include <cstring>          // memcpy
+#include <endian.h>         // 64-bit byte order conversion
+#include <string>           // String class
+#include <string_view>      // Non-owning views into receive buffers
+
+#define PROTO_VERSION 2
+#define FRAME_HEADER_SIZE 12
+#define MAX_FRAME_SIZE (1024 * 1024)
+#define MAX_PAYLOAD_SIZE (MAX_FRAME_SIZE - FRAME_HEADER_SIZE - 2 * 255)   // Fits whatever the names
+#define HEARTBEAT_MAGIC 0x4E554842u     // "NUHB"
+#define HEARTBEAT_VERSION 1
+#define HEARTBEAT_PACKET_SIZE 28
+#define MESSAGE_ID_SIZE 8
+#define ACK_PAYLOAD_SIZE (MESSAGE_ID_SIZE + 1)
+
+enum FrameType : uint8_t {
+    FRAME_SEND = 1,         // Client -> server: route payload to campus/dept
+    FRAME_DELIVER = 2,      // Server -> client: payload from campus/dept
+    FRAME_CREDIT = 3,       // Server -> client: SEND frames routed (see Window)
+    FRAME_ACK = 4,          // Both ways: outcome of a message with an id (see Ack)
+    FRAME_THROTTLE = 5      // Server -> client: a receiver is reading slowly
+};
+
+enum FrameFlag : uint16_t {
+    FRAME_FLAG_DEFLATE = 0x0001,    // Payload is a zlib stream
+    FRAME_FLAG_DICTIONARY = 0x0002, // ...made with the shared preset dictionary
+    FRAME_FLAG_ID = 0x0004          // Payload starts with a message id
+};
+
+enum AckStatus : uint8_t {
+    ACK_DELIVERED = 1,      // A receiving terminal got the message
+    ACK_FAILED = 2,         // No receiver, or a receiver could not decode it
+    ACK_SPOOLED = 3,        // Stored by the server for an offline department; not yet synced
+    ACK_FORWARDED = 4       // Queued for a receiver that does not acknowledge
+};
+
+enum ThrottleAction : uint8_t {
+    THROTTLE_BLOCKED = 1,       // The server stopped reading from the sender for now
+    THROTTLE_SHED_OLDEST = 2,   // Older messages queued for the receiver were dropped
+    THROTTLE_SHED_NEWEST = 3,   // The sender's message was dropped for that receiver
+    THROTTLE_DISCONNECTED = 4   // The receiver was disconnected; its queue was spooled
+};
+
+// A decoded frame. The views point into the caller's receive buffer and are
+// only valid until that buffer is modified.
+struct FrameView {
+    uint8_t type = 0;
+    uint16_t flags = 0;
+    std::string_view campus;
+    std::string_view department;
+    std::string_view payload;
+};
+
+enum class FrameStatus {
+    INCOMPLETE,     // Need more bytes before a whole frame is available
+    OK,             // One frame decoded
+    INVALID         // Stream is corrupt; drop the connection
+};
+
+// Append one encoded frame to out. Names longer than 255 bytes are refused.
+// Allocates only if out has to grow past its current capacity.
+inline bool encode_frame(std::string &out, uint8_t type, std::string_view campus,
+                         std::string_view department, std::string_view payload,
+                         uint16_t flags = 0) {
+    size_t total = FRAME_HEADER_SIZE + campus.size() + department.size() + payload.size();
+    if(campus.size() > 255 || department.size() > 255 || total > MAX_FRAME_SIZE) return false;
+
+    unsigned char header[FRAME_HEADER_SIZE] = {0};
+    uint32_t length = htonl((uint32_t)total);
+    uint16_t net_flags = htons(flags);
+    memcpy(header, &length, 4);
+    header[4] = PROTO_VERSION;
+    header[5] = type;
+    memcpy(header + 6, &net_flags, 2);
+    header[8] = (unsigned char)campus.size();
+    header[9] = (unsigned char)department.size();
+
+    out.append((const char*)header, FRAME_HEADER_SIZE);
+    out.append(campus.data(), campus.size());
+    out.append(department.data(), department.size());
+    out.append(payload.data(), payload.size());
+    return true;
+}
+
+// Decode the frame at the start of data in place, without copying. On OK,
+// frame_size is set to the number of bytes the frame occupied.
+inline FrameStatus decode_frame(const char *data, size_t available, FrameView &frame,
+                                size_t &frame_size) {
+    if(available < FRAME_HEADER_SIZE) return FrameStatus::INCOMPLETE;
+
+    const unsigned char *header = (const unsigned char*)data;
+    uint32_t length;
+    uint16_t flags;
+    memcpy(&length, header, 4);
+    memcpy(&flags, header + 6, 2);
+    length = ntohl(length);
+
+    size_t campus_len = header[8];
+    size_t dept_len = header[9];
+    if(header[4] != PROTO_VERSION || length > MAX_FRAME_SIZE ||
+       length < FRAME_HEADER_SIZE + campus_len + dept_len) {
+        return FrameStatus::INVALID;
+    }
+    if(available < length) return FrameStatus::INCOMPLETE;
+
+    const char *body = data + FRAME_HEADER_SIZE;
+    frame.type = header[5];
+    frame.flags = ntohs(flags);
+    frame.campus = std::string_view(body, campus_len);
+    frame.department = std::string_view(body + campus_len, dept_len);
+    frame.payload = std::string_view(body + campus_len + dept_len,
+                                     length - FRAME_HEADER_SIZE - campus_len - dept_len);
+    frame_size = length;
+    return FrameStatus::OK;
+}
+
+// FRAME_CREDIT carries no names, just the count
+inline bool encode_credit_frame(std::string &out, uint32_t count) {
+    uint32_t net_count = htonl(count);
+    return encode_frame(out, FRAME_CREDIT, {}, {}, std::string_view((const char*)&net_count, 4));
+}
+
+inline uint32_t decode_credit(std::string_view payload) {
+    uint32_t count = 0;
+    if(payload.size() == 4) memcpy(&count, payload.data(), 4);
+    return ntohl(count);
+}
+
+inline void append_message_id(std::string &out, uint64_t id) {
+    uint64_t net_id = htobe64(id);
+    out.append((const char*)&net_id, MESSAGE_ID_SIZE);
+}
+
+// The id at the start of a FRAME_FLAG_ID payload; the caller checks the size
+inline uint64_t read_message_id(std::string_view payload) {
+    uint64_t id;
+    memcpy(&id, payload.data(), MESSAGE_ID_SIZE);
+    return be64toh(id);
+}
+
+inline bool encode_ack_frame(std::string &out, std::string_view campus, std::string_view department,
+                             uint64_t id, AckStatus status) {
+    char payload[ACK_PAYLOAD_SIZE];
+    uint64_t net_id = htobe64(id);
+    memcpy(payload, &net_id, MESSAGE_ID_SIZE);
+    payload[MESSAGE_ID_SIZE] = (char)status;
+    return encode_frame(out, FRAME_ACK, campus, department, std::string_view(payload, ACK_PAYLOAD_SIZE));
+}
+
+inline bool decode_ack(std::string_view payload, uint64_t &id, uint8_t &status) {
+    if(payload.size() != ACK_PAYLOAD_SIZE) return false;
+    id = read_message_id(payload);
+    status = (uint8_t)payload[MESSAGE_ID_SIZE];
+    return status >= ACK_DELIVERED && status <= ACK_FORWARDED;
+}
+
+inline const char *throttle_action_name(uint8_t action) {
+    switch(action) {
+    case THROTTLE_BLOCKED: return "blocked";
+    case THROTTLE_SHED_OLDEST: return "shed-oldest";
+    case THROTTLE_SHED_NEWEST: return "shed-newest";
+    case THROTTLE_DISCONNECTED: return "disconnected";
+    default: return "unknown";
+    }
+}
+
+inline bool encode_throttle_frame(std::string &out, std::string_view campus, std::string_view department,
+                                  ThrottleAction action) {
+    char payload = (char)action;
+    return encode_frame(out, FRAME_THROTTLE, campus, department, std::string_view(&payload, 1));
+}
+
+struct HeartbeatPacket {
+    uint8_t flags = 0;
+    uint16_t campus_id = 0;
+    uint64_t conn_id = 0;
+    uint32_t sequence = 0;
+    uint64_t sent_ns = 0;
+};
+
+inline void encode_heartbeat(char (&out)[HEARTBEAT_PACKET_SIZE], const HeartbeatPacket &packet) {
+    uint32_t magic = htonl(HEARTBEAT_MAGIC);
+    uint16_t campus_id = htons(packet.campus_id);
+    uint64_t conn_id = htobe64(packet.conn_id);
+    uint32_t sequence = htonl(packet.sequence);
+    uint64_t sent_ns = htobe64(packet.sent_ns);
+    memcpy(out, &magic, 4);
+    out[4] = HEARTBEAT_VERSION;
+    out[5] = (char)packet.flags;
+    memcpy(out + 6, &campus_id, 2);
+    memcpy(out + 8, &conn_id, 8);
+    memcpy(out + 16, &sequence, 4);
+    memcpy(out + 20, &sent_ns, 8);
+}
+
+// Returns false for anything that is not a binary heartbeat of our version
+inline bool decode_heartbeat(const char *data, size_t length, HeartbeatPacket &packet) {
+    uint32_t magic;
+    if(length != HEARTBEAT_PACKET_SIZE) return false;
+    memcpy(&magic, data, 4);
+    if(ntohl(magic) != HEARTBEAT_MAGIC || (uint8_t)data[4] != HEARTBEAT_VERSION) return false;
+
+    uint16_t campus_id;
+    uint64_t conn_id, sent_ns;
+    uint32_t sequence;
+    memcpy(&campus_id, data + 6, 2);
+    memcpy(&conn_id, data + 8, 8);
+    memcpy(&sequence, data + 16, 4);
+    memcpy(&sent_ns, data + 20, 8);
+    packet.flags = (uint8_t)data[5];
+    packet.campus_id = ntohs(campus_id);
+    packet.conn_id = be64toh(conn_id);
+    packet.sequence = ntohl(sequence);
+    packet.sent_ns = be64toh(sent_ns);
+    return true;
+}
+
+#endif
@@ -3,44 +3,378 @@
 // TCP:54000 (Authentication & Messages), UDP:54001 (Heartbeats & Broadcast)
 // Network and system headers
 #include <arpa/inet.h>      // IP address conversion
+#include <dirent.h>         // Spool directory scan
+#include <fcntl.h>          // Non-blocking descriptor flags
 #include <netinet/in.h>     // Internet address structs
+#include <netinet/tcp.h>    // TCP_NODELAY
+#include <poll.h>           // Waiting for UDP send space
+#include <pthread.h>        // Worker CPU affinity
+#include <sys/epoll.h>      // Edge-triggered event notification
+#include <sys/eventfd.h>    // Reactor wakeup descriptor
+#include <sys/mman.h>       // Memory-mapped spool segments
 #include <sys/socket.h>     // Socket operations
+#include <sys/stat.h>       // Spool directory creation
 #include <sys/types.h>      // Data types for sockets
-#include <sys/select.h>     // I/O multiplexing
+#include <sys/uio.h>        // Scatter/gather I/O vectors
+#include <sys/un.h>         // Unix-socket metrics endpoint
 #include <unistd.h>         // POSIX API functions
 // C++ standard library headers
 #include <algorithm>        // STL algorithms (remove, find)
 #include <atomic>           // Thread-safe atomic variables
+#include <chrono>           // Durations
+#include <condition_variable>   // Spool group commit wakeups
 #include <cerrno>           // Error number definitions
+#include <cstdarg>          // Variadic log formatting
+#include <cstdio>           // Log sink output
 #include <cstring>          // C string manipulation
 #include <ctime>            // Time functions
 #include <iostream>         // Input/output streams
 #include <map>              // Key-value map container
+#include <memory>           // Smart pointers
 #include <mutex>            // Mutual exclusion locks
 #include <sstream>          // String stream operations
+#include <stdexcept>        // Standard exceptions
 #include <string>           // String class
+#include <string_view>      // Non-owning string views
 #include <thread>           // Thread management
+#include <unordered_map>    // Hash map container
 #include <vector>           // Dynamic array container
+// Project headers
+#include "protocol.h"       // Framed wire protocol
+#include "compress.h"       // Payload compression
+#include "metrics.h"        // Counters and latency histograms
+#include "session.h"        // Resumable session tokens
+#include "handoff.h"        // Socket handoff to a new server process
+// The io_uring backend is built whenever the kernel header is available;
+// compile with -DNU_NO_IO_URING to leave it out
+#if !defined(NU_NO_IO_URING) && __has_include(<linux/io_uring.h>)
+#define NU_HAVE_IO_URING
+#include "uring.h"          // Minimal io_uring ring
+#endif
 
 #define TCP_PORT 54000
 #define UDP_PORT 54001
 #define BUFFER_SIZE 8192
+#define MAX_EVENTS 256
+#define MAX_PENDING_INPUT (64 * 1024)
+#define MAX_RETAINED_BUFFER (256 * 1024)
+#define FLUSH_BATCH_BYTES (64 * 1024)   // Queued bytes that end a --flush-delay-ms wait early
+#define MAX_RCU_READERS 128
+#define LOG_RING_CAPACITY 4096          // Records per thread, power of two
+#define LOG_RECORD_TEXT 244
+#define LOG_POLL_INTERVAL_MS 2
+#define BROADCAST_BATCH 64              // Datagrams per sendmmsg call
+#define BROADCAST_SEND_TIMEOUT_MS 100
+#define UDP_BATCH 64                    // Datagrams per recvmmsg call
+#define UDP_DATAGRAM_SIZE 512           // Heartbeats are far smaller
+#define WHEEL_SLOTS 64                  // Slots per timing wheel level, power of two
+#define WHEEL_LEVELS 3                  // 64^3 one-second ticks, about three days
+#define AUTH_TIMEOUT_SECONDS 30
+#define SPOOL_SEGMENT_SIZE (4 * 1024 * 1024)
+#define SPOOL_RECORD_HEADER 16
+#define SPOOL_SYNC_INTERVAL_MS 50       // Longest a spooled message waits for msync
+#define SPOOL_SYNC_BATCH 64             // Records that trigger an early msync
+#define URING_ENTRIES 1024              // Submission queue size per worker
+#define URING_RECV_BUFFERS 512          // Provided TCP receive buffers per worker, power of two
+#define URING_UDP_BUFFERS 256           // Provided UDP receive buffers, power of two
+#define MAX_CREDIT_WINDOW 4096          // Largest Window a client is granted
+#define DEFAULT_MAX_QUEUED_BYTES (4 * 1024 * 1024)  // Per connection; see --max-queued-bytes
+#define DEFAULT_SESSION_TTL 600         // Seconds a session token stays valid
+#define THROTTLE_NOTICE_INTERVAL_MS 1000    // Fewest milliseconds between notices to one sender
+#define METRICS_POLL_INTERVAL_MS 200    // Scrape endpoint's shutdown check
+#define METRICS_REQUEST_TIMEOUT_MS 1000 // Longest a scraper may take to send its request
+#define HANDOFF_POLL_INTERVAL_MS 200    // Handoff listener's shutdown check
+#define HANDOFF_TIMEOUT_MS 10000        // Longest either side waits on the other during a handoff
+#define HANDOFF_QUIESCE_MS 1000         // Longest io_uring may take to let go of handed-over sockets
 
 using namespace std;
 
+// A sender whose reads are paused until a full queue drains
+struct PausedSender {
+    int worker_id;
+    int fd;
+    uint64_t conn_id;
+};
+
+// Bytes waiting to be written to one campus socket. Any thread may append
+// encoded messages; only the owning worker takes them, so routing never
+// touches the socket itself. The buffer keeps its capacity between flushes.
+struct OutboundQueue {
+    mutex lock;
+    string buffer;
+    bool flush_scheduled = false;   // Owner already has us on its flush list
+    atomic<size_t> pending_bytes{0};    // Queued or not yet written; read without the lock
+    atomic<uint64_t> write_calls{0};    // sendmsg calls that wrote something, owner only
+    atomic<uint64_t> bytes_written{0};
+    // Slow-consumer state (see admit_to_full_queue)
+    bool closed = false;                        // The owner closed the connection
+    vector<PausedSender> blocked_senders;       // Waiting for us to drain (block policy)
+    atomic<bool> has_blocked_senders{false};    // blocked_senders may be non-empty; read without the lock
+    atomic<bool> overflowed{false};             // Past the limit under the disconnect policy
+};
+
+// Registry entry for one authenticated connection. Identity fields never
+// change after publication; heartbeat state is updated in place atomically.
 struct ClientInfo {
     int tcp_sock = -1;
+    int worker_id = 0;          // Worker whose event loop owns tcp_sock
+    uint64_t conn_id = 0;       // Guards against fd reuse across workers
+    int proto = 1;              // 1 = text lines, PROTO_VERSION = frames
+    uint16_t frame_flags = 0;   // Payload encodings it reads (FrameFlag bits)
+    int campus_id = -1;
+    shared_ptr<OutboundQueue> outbound;
     string campus;
     string department;
-    sockaddr_in udp_addr{};
-    bool has_udp = false;
-    string last_seen;
+    mutable atomic<uint64_t> udp_endpoint{0};   // pack_endpoint() of heartbeat source, 0 = none
+    mutable atomic<int64_t> last_seen_ms{0};    // monotonic_ms() of the last heartbeat
+};
+
+// One (campus, department) subscription. The department view points into
+// a ClientInfo owned by the same snapshot.
+struct SubscriptionKey {
+    int campus_id;
+    string_view department;
+    
+    bool operator==(const SubscriptionKey &other) const {
+        return campus_id == other.campus_id && department == other.department;
+    }
+};
+
+struct SubscriptionKeyHash {
+    size_t operator()(const SubscriptionKey &key) const {
+        return hash<string_view>()(key.department) * 31 + key.campus_id;
+    }
+};
+
+// Every connection subscribed to one (campus, department); several terminals
+// of the same department share its traffic according to delivery_mode
+struct SubscriptionGroup {
+    vector<const ClientInfo*> members;
+    mutable atomic<uint32_t> next_member{0};    // Round-robin cursor
+};
+
+// Immutable view of every connected campus department. Writers change
+// clients on a copy and publish it; readers never lock (see RegistryReader).
+struct RegistrySnapshot {
+    vector<shared_ptr<ClientInfo>> clients;     // Every authenticated connection
+    // Fan-out lists derived from clients on every publish, so routing to any
+    // target, wildcard or not, is one lookup rather than a scan
+    unordered_map<SubscriptionKey, SubscriptionGroup, SubscriptionKeyHash> by_address;  // Campus:Dept
+    vector<const SubscriptionGroup*> everyone;                                  // *:*
+    vector<vector<const SubscriptionGroup*>> by_campus;                         // Campus:*, by campus id
+    unordered_map<string_view, vector<const SubscriptionGroup*>> by_department; // *:Dept
+};
+
+// The groups a target resolved to: one exact group or a run of a fan-out list
+struct TargetList {
+    const SubscriptionGroup *single = nullptr;
+    const SubscriptionGroup *const *first = nullptr;
+    size_t count = 0;
+    
+    const SubscriptionGroup *operator[](size_t i) const { return single ? single : first[i]; }
+};
+
+enum class DeliveryMode {
+    FANOUT,         // Every connection of the group gets a copy
+    ROUND_ROBIN,    // Connections of the group take turns
+    LEAST_QUEUED    // The connection with the fewest bytes waiting
+};
+
+// Per-socket state machine, owned exclusively by one worker's event loop
+enum class ConnState {
+    AWAIT_AUTH,     // Waiting for the Campus:..,Pass:..,Dept:.. line
+    ACTIVE          // Authenticated, accepting SEND: lines or frames
+};
+
+struct Connection {
+    int fd = -1;
+    uint64_t id = 0;
+    ConnState state = ConnState::AWAIT_AUTH;
+    int proto = 1;
+    uint16_t frame_flags = 0;   // Negotiated at auth, as in ClientInfo
+    uint32_t credit_window = 0; // Window granted at auth; 0 = no FRAME_CREDIT
+    uint32_t uncredited = 0;    // Frames routed since the last credit
+    int campus_id = -1;
+    string campus;
+    string department;
+    string in_buf;      // Reassembly buffer: bytes not yet parsed
+    shared_ptr<OutboundQueue> outbound = make_shared<OutboundQueue>();
+    string sending;         // Bytes taken from outbound, not yet fully written
+    size_t send_offset = 0; // Bytes of sending already written
+    string staged;          // Taken while sending was still blocked; written after it
+    bool flush_deferred = false;    // On the worker's deferred list (--flush-delay-ms)
+    shared_ptr<const ClientInfo> registration;  // Our registry entry once ACTIVE
+    uint64_t liveness_due = 0;  // Tick of the one live timer; others are stale
+    bool send_in_flight = false;    // io_uring: the kernel is writing from sending
+    int64_t send_started_ns = 0;    // io_uring: when the in-flight send was submitted
+    bool recv_armed = false;        // io_uring: the multishot recv is still posting
+    bool recv_cancelling = false;   // io_uring: ...and a cancel for it was submitted
+    bool paused = false;            // Not reading: a target's queue is full (block policy)
+    int64_t paused_ns = 0;          // When paused was set
+    int64_t throttle_notice_ms = 0; // When the sender was last told it is throttled
+};
+
+// A connection whose outbound queue gained frames since its last flush
+struct FlushRequest {
+    int fd;
+    uint64_t conn_id;
+};
+
+// A flush held back to let more messages coalesce into the same write
+struct DeferredFlush {
+    int fd;
+    uint64_t conn_id;
+    int64_t due_ms;     // monotonic_ms() deadline
+};
+
+// A connection that authenticated this loop pass, not yet in the registry
+struct PendingRegistration {
+    int fd;
+    uint64_t conn_id;
+    shared_ptr<ClientInfo> info;
+};
+
+// Liveness deadline for one connection. Entries are never cancelled: a
+// closed or reused fd is recognised by conn_id, a superseded deadline by
+// Connection::liveness_due, when the timer fires.
+struct WheelTimer {
+    int fd;
+    uint64_t conn_id;
+    uint64_t expires;       // Absolute tick
+};
+
+// Hierarchical timing wheel with one-second ticks. Level L slots each span
+// WHEEL_SLOTS^L ticks; a higher-level slot is cascaded down when the level
+// below wraps. Scheduling is O(1), and a tick only touches the timers that
+// land in it, however many connections there are.
+class TimingWheel {
+public:
+    void start(uint64_t now) { current = now; }
+    
+    // Returns the tick the timer will actually fire at
+    uint64_t schedule(const WheelTimer &timer) {
+        return place({timer.fd, timer.conn_id, max(timer.expires, current + 1)});
+    }
+    
+    // Fire every timer due at or before now. on_expire may schedule again.
+    template<typename Callback>
+    void advance(uint64_t now, Callback &&on_expire) {
+        while(current < now) {
+            current++;
+            for(int level = WHEEL_LEVELS - 1; level > 0; level--) {
+                if(current % level_span(level) != 0) continue;
+                cascade(slots[level][(current / level_span(level)) % WHEEL_SLOTS]);
+            }
+            
+            vector<WheelTimer> &slot = slots[0][current % WHEEL_SLOTS];
+            expired.swap(slot);
+            for(const WheelTimer &timer : expired) on_expire(timer);
+            expired.clear();
+        }
+    }
+    
+private:
+    static uint64_t level_span(int level) {
+        uint64_t span = 1;
+        for(int i = 0; i < level; i++) span *= WHEEL_SLOTS;
+        return span;
+    }
+    
+    // Cascaded timers may be due this very tick; they land in the level 0
+    // slot that advance() is about to fire
+    uint64_t place(const WheelTimer &timer) {
+        uint64_t expires = timer.expires;
+        uint64_t delta = expires - current;
+        int level = 0;
+        while(level + 1 < WHEEL_LEVELS && delta >= level_span(level + 1)) level++;
+        if(delta >= level_span(WHEEL_LEVELS)) {
+            // Beyond the wheel: park in the farthest slot, re-armed on expiry
+            expires = current + level_span(WHEEL_LEVELS) - 1;
+        }
+        slots[level][(expires / level_span(level)) % WHEEL_SLOTS].push_back({timer.fd, timer.conn_id, expires});
+        return expires;
+    }
+    
+    void cascade(vector<WheelTimer> &slot) {
+        cascading.swap(slot);
+        for(const WheelTimer &timer : cascading) place(timer);
+        cascading.clear();
+    }
+    
+    uint64_t current = 0;
+    vector<WheelTimer> slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    vector<WheelTimer> expired;     // Scratch, keeps its capacity between ticks
+    vector<WheelTimer> cascading;
+};
+
+// One event loop per worker; each owns a SO_REUSEPORT listener and the
+// connections the kernel hands to it. Worker 0 also owns the UDP socket.
+struct Worker {
+    int id = 0;
+    int listen_fd = -1;
+    int epoll_fd = -1;
+    int wakeup_fd = -1;
+    unordered_map<int, Connection> connections;
+    mutex flush_mutex;
+    vector<FlushRequest> flush_list;    // Filled by any worker, drained here
+    vector<FlushRequest> resume_list;   // Paused senders to read from again, also under flush_mutex
+    TimingWheel liveness;               // Heartbeat and auth deadlines
+    vector<DeferredFlush> deferred;     // Oldest first, so due_ms is ascending
+    vector<PendingRegistration> registrations;  // Logins and logouts of this pass, published
+    vector<shared_ptr<const ClientInfo>> removals;  // together by publish_registry_changes
+    atomic<uint64_t> write_calls{0};    // Socket writes by this worker
+    atomic<uint64_t> bytes_written{0};
+#ifdef NU_HAVE_IO_URING
+    unique_ptr<IoUring> uring;          // Set only when the io_uring backend is in use
+    unique_ptr<BufferRing> recv_buffers;
+    unique_ptr<BufferRing> udp_buffers; // Worker 0 only
+    msghdr udp_msg{};                   // Shape of the multishot UDP recvmsg
+    uint64_t wakeup_count = 0;          // eventfd read target
+    bool accept_armed = false;          // The multishot accept is still posting
+    bool udp_armed = false;             // ...and the multishot UDP recvmsg (worker 0)
+    // Closed connections whose last send is still in flight; the node keeps
+    // the buffer alive (and in place) until its completion arrives
+    unordered_map<uint64_t, unordered_map<int, Connection>::node_type> orphaned_sends;
+#endif
+};
+
+// What happens to a message for a connection with max_queued_bytes waiting
+enum class SlowConsumerPolicy {
+    BLOCK,          // Queue it, and stop reading from the sender until the queue halves
+    SHED_OLDEST,    // Drop the oldest queued messages down to half the limit
+    SHED_NEWEST,    // Drop this message for that connection
+    DISCONNECT      // Close the slow connection; its queue goes to the spool
+};
+
+enum class IoBackend {
+    EPOLL,          // Edge-triggered epoll with nonblocking syscalls
+    IO_URING        // Multishot receives and ring-submitted sends
 };
 
-map<string, ClientInfo> connected_clients;
-map<int, string> socket_to_campus;
-mutex clients_mutex;
 atomic<bool> server_running{true};
+atomic<uint64_t> next_conn_id{1};
+DeliveryMode delivery_mode = DeliveryMode::FANOUT;
+int flush_delay_ms = 0;         // 0 = write at the end of every event loop pass
+IoBackend io_backend = IoBackend::EPOLL;
+int heartbeat_interval = 60;    // Seconds; matches the client's send_heartbeat
+int heartbeat_misses = 3;       // Missed heartbeats before a campus is evicted
+string compress_dictionary;     // --compress-dict; empty = none
+uint32_t compress_dictionary_id = 0;
+SlowConsumerPolicy slow_consumer_policy = SlowConsumerPolicy::BLOCK;
+size_t max_queued_bytes = DEFAULT_MAX_QUEUED_BYTES;    // 0 = unbounded
+atomic<int64_t> paused_senders{0};
+int listen_backlog = SOMAXCONN;     // Pending connections per listener; the kernel caps it at somaxconn
+int session_ttl = DEFAULT_SESSION_TTL;  // 0 = no session tokens
+string session_key_path;        // --session-key; empty = <spool-dir>/session.key
+SessionKey session_key;
+string handoff_path;            // --handoff; empty = no hot restart
+bool handoff_clients = false;   // --handoff-clients: ask the old server for its connections too
+atomic<bool> hand_over_connections{false};  // A successor took our connections; workers keep them open
+bool handed_over = false;       // Our sockets belong to a successor now; close without shutdown
+atomic<bool> quit_requested{false};     // "quit" typed; a failed handoff does not resume serving
+
+vector<unique_ptr<Worker>> workers;
+thread_local Worker *current_worker = nullptr;
 
 // Hard-coded credentials
 map<string, string> campus_credentials = {
@@ -51,267 +385,2556 @@ map<string, string> campus_credentials = {
     {"Multan", "NU-MLT-123"}
 };
 
-string get_current_time() {
-    time_t now = time(nullptr);
+// Liveness is measured on the monotonic clock so wall-clock jumps never
+// evict (or resurrect) a campus
+int64_t monotonic_ms() {
+    return chrono::duration_cast<chrono::milliseconds>(
+        chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+uint64_t current_tick() {
+    return (uint64_t)(monotonic_ms() / 1000);
+}
+
+string format_time(time_t when) {
     char time_buf[64];
-    ctime_r(&now, time_buf);
+    ctime_r(&when, time_buf);
     string time_str(time_buf);
     if(!time_str.empty() && time_str.back() == '\n')
         time_str.pop_back();
     return time_str;
 }
 
+// ---- Asynchronous logging ----
+// Each thread formats records into its own single-producer ring; one
+// background thread drains every ring to stdout and the optional file sink.
+// The hot path is a vsnprintf into a preallocated slot: no locks, no heap,
+// no flush. A full ring drops the record and counts it.
+
+enum LogLevel : uint8_t { LOG_DEBUG, LOG_INFO, LOG_WARN, LOG_ERROR };
+
+struct LogRecord {
+    uint64_t sequence;      // Global order, so rings can be merged on output
+    time_t timestamp;
+    LogLevel level;
+    uint16_t length;
+    char text[LOG_RECORD_TEXT];
+};
+
+struct LogRing {
+    alignas(64) atomic<uint64_t> head{0};   // Next slot the producer writes
+    alignas(64) atomic<uint64_t> tail{0};   // Next slot the logger reads
+    atomic<uint64_t> dropped{0};
+    LogRecord records[LOG_RING_CAPACITY];
+};
+
+atomic<LogLevel> log_level{LOG_INFO};
+atomic<time_t> log_clock{0};        // Coarse wall clock refreshed by the logger
+atomic<uint64_t> log_sequence{0};
+atomic<uint64_t> log_records_dropped{0};   // Since startup; rings only hold those not yet reported
+atomic<bool> logger_running{false};
+mutex log_rings_mutex;              // Guards ring registration only
+vector<unique_ptr<LogRing>> log_rings;
+FILE *log_file = nullptr;
+thread logger_thread;
+thread_local LogRing *thread_log_ring = nullptr;
+
+LogRing &current_log_ring() {
+    if(thread_log_ring == nullptr) {
+        lock_guard<mutex> lock(log_rings_mutex);
+        log_rings.emplace_back(new LogRing());
+        thread_log_ring = log_rings.back().get();
+    }
+    return *thread_log_ring;
+}
+
+__attribute__((format(printf, 2, 3)))
+void log_event(LogLevel level, const char *format, ...) {
+    if(level < log_level.load(memory_order_relaxed)) return;
+    
+    LogRing &ring = current_log_ring();
+    uint64_t head = ring.head.load(memory_order_relaxed);
+    if(head - ring.tail.load(memory_order_acquire) >= LOG_RING_CAPACITY) {
+        ring.dropped.fetch_add(1, memory_order_relaxed);
+        return;
+    }
+    
+    LogRecord &record = ring.records[head & (LOG_RING_CAPACITY - 1)];
+    time_t now = log_clock.load(memory_order_relaxed);
+    record.timestamp = now != 0 ? now : time(nullptr);
+    record.level = level;
+    record.sequence = log_sequence.fetch_add(1, memory_order_relaxed);
+    
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(record.text, sizeof(record.text), format, args);
+    va_end(args);
+    record.length = (uint16_t)min<int>(max(length, 0), sizeof(record.text) - 1);
+    
+    ring.head.store(head + 1, memory_order_release);
+}
+
 void server_log(const string &message) {
-    cout << "[" << get_current_time() << "] " << message << endl;
+    log_event(LOG_INFO, "%s", message.c_str());
 }
 
-bool send_tcp_message(int socket, const string &message) {
-    string formatted_msg = message + "\n";
-    return send(socket, formatted_msg.c_str(), formatted_msg.size(), 0) > 0;
+void write_log_line(FILE *sink, const char *stamp, const LogRecord &record) {
+    static const char *level_tags[] = {"DEBUG ", "", "WARN ", "ERROR "};
+    fprintf(sink, "[%s] %s%.*s\n", stamp, level_tags[record.level], (int)record.length, record.text);
 }
 
-void route_campus_message(const string &source_campus, const string &source_dept,
-                         const string &target_campus, const string &message_text) {
-    lock_guard<mutex> lock(clients_mutex);
+// Drain all rings once, merged back into global order; returns the number
+// of records written
+size_t drain_log_rings() {
+    static time_t stamp_time = 0;
+    static string stamp = format_time(time(nullptr));
+    static vector<const LogRecord*> pending;
+    static vector<pair<LogRing*, uint64_t>> drained_to;
+    uint64_t dropped = 0;
     
-    auto target_client = connected_clients.find(target_campus);
-    if(target_client == connected_clients.end()) {
-        server_log("Routing failed: Campus '" + target_campus + "' is not connected.");
-        return;
+    lock_guard<mutex> lock(log_rings_mutex);
+    pending.clear();
+    drained_to.clear();
+    for(auto &ring : log_rings) {
+        uint64_t tail = ring->tail.load(memory_order_relaxed);
+        uint64_t head = ring->head.load(memory_order_acquire);
+        for(uint64_t slot = tail; slot != head; slot++) {
+            pending.push_back(&ring->records[slot & (LOG_RING_CAPACITY - 1)]);
+        }
+        drained_to.push_back({ring.get(), head});
+        dropped += ring->dropped.exchange(0, memory_order_relaxed);
+    }
+    log_records_dropped.fetch_add(dropped, memory_order_relaxed);
+    
+    sort(pending.begin(), pending.end(), [](const LogRecord *a, const LogRecord *b) {
+        return a->sequence < b->sequence;
+    });
+    for(const LogRecord *record : pending) {
+        if(record->timestamp != stamp_time) {
+            stamp_time = record->timestamp;
+            stamp = format_time(stamp_time);
+        }
+        write_log_line(stdout, stamp.c_str(), *record);
+        if(log_file != nullptr) write_log_line(log_file, stamp.c_str(), *record);
     }
     
-    int target_socket = target_client->second.tcp_sock;
-    string formatted_message = "FROM:" + source_campus + ":" + source_dept + ":" + message_text;
+    // Slots are only handed back to producers once they have been written
+    for(auto &drained : drained_to) drained.first->tail.store(drained.second, memory_order_release);
     
-    if(send_tcp_message(target_socket, formatted_message)) {
-        server_log("Message routed from " + source_campus + " to " + target_campus);
-    } else {
-        server_log("Failed to send message to " + target_campus);
+    if(dropped > 0) {
+        fprintf(stdout, "[%s] WARN %llu log records dropped (ring full)\n",
+                stamp.c_str(), (unsigned long long)dropped);
+    }
+    if(!pending.empty() || dropped > 0) {
+        fflush(stdout);
+        if(log_file != nullptr) fflush(log_file);
     }
+    return pending.size();
 }
 
-void handle_campus_client(int client_socket) {
-    char buffer[BUFFER_SIZE];
-    ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
+void logger_loop() {
+    while(logger_running) {
+        log_clock.store(time(nullptr), memory_order_relaxed);
+        if(drain_log_rings() == 0) {
+            this_thread::sleep_for(chrono::milliseconds(LOG_POLL_INTERVAL_MS));
+        }
+    }
+    drain_log_rings();
+}
+
+bool start_logger(const string &file_path) {
+    if(!file_path.empty()) {
+        log_file = fopen(file_path.c_str(), "a");
+        if(log_file == nullptr) {
+            perror("Cannot open log file");
+            return false;
+        }
+    }
+    log_clock = time(nullptr);
+    logger_running = true;
+    logger_thread = thread(logger_loop);
+    return true;
+}
+
+void stop_logger() {
+    if(!logger_running) return;
+    logger_running = false;
+    logger_thread.join();
+    if(log_file != nullptr) {
+        fclose(log_file);
+        log_file = nullptr;
+    }
+}
+
+// ---- Metrics ----
+// Counters and stage latencies, one set per recording thread (see
+// metrics.h). The admin "stats" command and the --metrics-listen endpoint
+// add the sets up when asked; recording costs no lock and no shared write.
+
+enum MetricId : uint8_t {
+    METRIC_CONNECTIONS_ACCEPTED,
+    METRIC_CONNECTIONS_CLOSED,
+    METRIC_CONNECTIONS_ADOPTED,
+    METRIC_AUTH_SUCCEEDED,
+    METRIC_AUTH_FAILED,
+    METRIC_AUTH_TIMEOUTS,
+    METRIC_SESSIONS_RESUMED,
+    METRIC_SESSIONS_REJECTED,
+    METRIC_REGISTRY_PUBLISHES,
+    METRIC_EVICTIONS,
+    METRIC_BYTES_RECEIVED,
+    METRIC_MESSAGES_RECEIVED,
+    METRIC_MESSAGES_ROUTED,
+    METRIC_MESSAGES_SPOOLED,
+    METRIC_MESSAGES_UNROUTABLE,
+    METRIC_DELIVERIES,
+    METRIC_ACKS_RELAYED,
+    METRIC_HEARTBEATS,
+    METRIC_HEARTBEATS_INVALID,
+    METRIC_BROADCASTS,
+    METRIC_BROADCAST_DATAGRAMS,
+    METRIC_BROADCAST_FAILURES,
+    METRIC_SENDERS_BLOCKED,
+    METRIC_MESSAGES_SHED_OLDEST,
+    METRIC_MESSAGES_SHED_NEWEST,
+    METRIC_SLOW_CONSUMERS_DISCONNECTED,
+    METRIC_THROTTLE_NOTICES,
+    METRIC_COUNT
+};
+
+struct MetricInfo {
+    const char *name;       // Prometheus name; "stats" drops the nu_ and _total
+    const char *help;
+};
+
+const MetricInfo metric_info[METRIC_COUNT] = {
+    {"nu_connections_accepted_total", "TCP connections accepted"},
+    {"nu_connections_closed_total", "TCP connections closed, for any reason"},
+    {"nu_connections_adopted_total", "Live connections taken over from the previous server process"},
+    {"nu_auth_succeeded_total", "Campus logins accepted"},
+    {"nu_auth_failed_total", "Campus logins refused"},
+    {"nu_auth_timeouts_total", "Connections closed for not authenticating in time"},
+    {"nu_sessions_resumed_total", "Logins by session token"},
+    {"nu_sessions_rejected_total", "Session tokens refused as expired or invalid"},
+    {"nu_registry_publishes_total", "Registry snapshots published"},
+    {"nu_evictions_total", "Campuses disconnected for missing heartbeats"},
+    {"nu_bytes_received_total", "TCP bytes read from campuses"},
+    {"nu_messages_received_total", "SEND frames and lines received"},
+    {"nu_messages_routed_total", "Messages queued for at least one receiver"},
+    {"nu_messages_spooled_total", "Messages spooled for an offline department"},
+    {"nu_messages_unroutable_total", "Messages with no receiver and no spool"},
+    {"nu_deliveries_total", "Message copies queued for receivers"},
+    {"nu_acks_relayed_total", "Receiver acknowledgements passed back to senders"},
+    {"nu_heartbeats_total", "Heartbeat datagrams applied"},
+    {"nu_heartbeats_invalid_total", "UDP datagrams that were not heartbeats"},
+    {"nu_broadcasts_total", "Admin broadcasts"},
+    {"nu_broadcast_datagrams_total", "Broadcast datagrams sent"},
+    {"nu_broadcast_failures_total", "Broadcast datagrams that could not be sent"},
+    {"nu_senders_blocked_total", "Times a sender's reads were paused behind a full queue"},
+    {"nu_messages_shed_oldest_total", "Queued messages dropped to make room for newer ones"},
+    {"nu_messages_shed_newest_total", "Message copies dropped at a full queue"},
+    {"nu_slow_consumers_disconnected_total", "Connections closed for letting their queue fill"},
+    {"nu_throttle_notices_total", "Throttle notices sent to senders"}
+};
+
+// Timed stages. parse is framing a message out of the input buffer, route
+// is everything from there until it is queued (or spooled), send is one
+// socket write (sendmsg call, or io_uring submission to completion),
+// heartbeat is applying one UDP batch and broadcast one whole broadcast.
+// blocked is how long a sender's reads stayed paused behind a full queue.
+enum Stage : uint8_t {
+    STAGE_AUTH, STAGE_PARSE, STAGE_ROUTE, STAGE_SEND, STAGE_HEARTBEAT, STAGE_BROADCAST, STAGE_BLOCKED, STAGE_COUNT
+};
+
+const char *stage_names[STAGE_COUNT] = {"auth", "parse", "route", "send", "heartbeat", "broadcast", "blocked"};
+
+struct ThreadMetrics {
+    MetricCounter counters[METRIC_COUNT];
+    LatencyHistogram stages[STAGE_COUNT];
+};
+
+mutex metrics_mutex;                // Guards registration only
+vector<unique_ptr<ThreadMetrics>> metric_sets;
+thread_local ThreadMetrics *thread_metrics = nullptr;
+
+ThreadMetrics &current_metrics() {
+    if(thread_metrics == nullptr) {
+        lock_guard<mutex> lock(metrics_mutex);
+        metric_sets.emplace_back(new ThreadMetrics());
+        thread_metrics = metric_sets.back().get();
+    }
+    return *thread_metrics;
+}
+
+void count_metric(MetricId id, uint64_t amount = 1) {
+    current_metrics().counters[id].add(amount);
+}
+
+int64_t monotonic_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void record_stage(Stage stage, int64_t started_ns, int64_t finished_ns = 0) {
+    if(finished_ns == 0) finished_ns = monotonic_ns();
+    current_metrics().stages[stage].record(finished_ns - started_ns);
+}
+
+uint64_t metric_total(MetricId id) {
+    lock_guard<mutex> lock(metrics_mutex);
+    uint64_t total = 0;
+    for(const auto &set : metric_sets) total += set->counters[id].get();
+    return total;
+}
+
+HistogramSnapshot stage_snapshot(Stage stage) {
+    lock_guard<mutex> lock(metrics_mutex);
+    HistogramSnapshot snapshot;
+    for(const auto &set : metric_sets) snapshot.add(set->stages[stage]);
+    return snapshot;
+}
+
+// Campus names are interned to small ids: their index in campus_names,
+// which is campus_credentials in (sorted) key order and never changes.
+vector<string> campus_names;
+
+void intern_campuses() {
+    for(const auto &cred : campus_credentials) campus_names.push_back(cred.first);
+}
+
+int campus_id(string_view name) {
+    auto it = lower_bound(campus_names.begin(), campus_names.end(), name);
+    if(it == campus_names.end() || *it != name) return -1;
+    return (int)(it - campus_names.begin());
+}
+
+uint64_t pack_endpoint(const sockaddr_in &addr) {
+    return ((uint64_t)addr.sin_addr.s_addr << 16) | addr.sin_port;
+}
+
+sockaddr_in unpack_endpoint(uint64_t packed) {
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = (uint32_t)(packed >> 16);
+    addr.sin_port = (uint16_t)(packed & 0xFFFF);
+    return addr;
+}
+
+// ---- Client registry: epoch-based RCU ----
+// Readers announce the global epoch in a per-thread slot, load the current
+// snapshot and use it without taking any lock. Writers (auth and disconnect
+// only) copy the snapshot, publish the copy, bump the epoch and free the old
+// snapshot once no reader slot holds an epoch at or before its retirement.
+
+struct alignas(64) RcuReaderSlot {
+    atomic<uint64_t> epoch{0};      // 0 = not inside a read section
+    atomic<bool> in_use{false};
+};
+
+RcuReaderSlot rcu_readers[MAX_RCU_READERS];
+atomic<uint64_t> rcu_epoch{1};
+atomic<const RegistrySnapshot*> registry{nullptr};
+mutex registry_write_mutex;     // Serializes writers; readers never take it
+vector<pair<uint64_t, const RegistrySnapshot*>> retired_snapshots;
+
+// Claims a reader slot for the calling thread and releases it at thread exit
+struct RcuThreadSlot {
+    RcuReaderSlot *slot = nullptr;
+    int depth = 0;
     
-    if(bytes_received <= 0) {
-        close(client_socket);
-        return;
+    RcuThreadSlot() {
+        for(auto &candidate : rcu_readers) {
+            bool expected = false;
+            if(candidate.in_use.compare_exchange_strong(expected, true)) {
+                slot = &candidate;
+                return;
+            }
+        }
+        throw runtime_error("Too many registry reader threads");
+    }
+    ~RcuThreadSlot() { slot->in_use = false; }
+};
+
+thread_local RcuThreadSlot rcu_thread_slot;
+
+// RAII read-side critical section; the snapshot stays valid until it ends
+class RegistryReader {
+public:
+    RegistryReader() {
+        if(rcu_thread_slot.depth++ == 0) {
+            rcu_thread_slot.slot->epoch.store(rcu_epoch.load());
+        }
+        snapshot = registry.load();
+    }
+    ~RegistryReader() {
+        if(--rcu_thread_slot.depth == 0) rcu_thread_slot.slot->epoch.store(0);
     }
+    RegistryReader(const RegistryReader&) = delete;
+    RegistryReader &operator=(const RegistryReader&) = delete;
     
-    buffer[bytes_received] = '\0';
-    string auth_data(buffer);
+    const RegistrySnapshot *operator->() const { return snapshot; }
+    const RegistrySnapshot &operator*() const { return *snapshot; }
     
-    // Parse authentication
-    string campus_name, password, department;
+private:
+    const RegistrySnapshot *snapshot;
+};
+
+// Free retired snapshots no reader can still hold; caller holds the write mutex
+void reclaim_snapshots() {
+    uint64_t oldest_reader = UINT64_MAX;
+    for(auto &reader : rcu_readers) {
+        uint64_t epoch = reader.epoch.load();
+        if(epoch != 0 && epoch < oldest_reader) oldest_reader = epoch;
+    }
     
-    istringstream auth_stream(auth_data);
-    string token;
-    while(getline(auth_stream, token, ',')) {
-        size_t colon_pos = token.find(':');
-        if(colon_pos == string::npos) continue;
+    auto keep = retired_snapshots.begin();
+    for(auto &retired : retired_snapshots) {
+        if(retired.first < oldest_reader) delete retired.second;
+        else *keep++ = retired;
+    }
+    retired_snapshots.erase(keep, retired_snapshots.end());
+}
+
+void index_registry(RegistrySnapshot &snapshot) {
+    snapshot.by_campus.resize(campus_names.size());
+    for(const auto &client : snapshot.clients) {
+        const ClientInfo *entry = client.get();
+        // Map nodes never move, so the lists can point straight at groups
+        SubscriptionGroup &group = snapshot.by_address[{entry->campus_id, entry->department}];
+        group.members.push_back(entry);
+        if(group.members.size() > 1) continue;
+        snapshot.everyone.push_back(&group);
+        snapshot.by_campus[entry->campus_id].push_back(&group);
+        snapshot.by_department[entry->department].push_back(&group);
+    }
+}
+
+// mutate edits the list of clients; the indexes are rebuilt afterwards
+template<typename Mutator>
+void update_registry(Mutator &&mutate) {
+    lock_guard<mutex> lock(registry_write_mutex);
+    auto *next = new RegistrySnapshot();
+    next->clients = registry.load()->clients;
+    mutate(next->clients);
+    index_registry(*next);
+    count_metric(METRIC_REGISTRY_PUBLISHES);
+    const RegistrySnapshot *previous = registry.exchange(next);
+    retired_snapshots.push_back({rcu_epoch.fetch_add(1), previous});
+    reclaim_snapshots();
+}
+
+bool set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    return flags >= 0 && fcntl(fd, F_SETFL, flags | O_NONBLOCK) == 0;
+}
+
+void wake_worker(Worker &worker) {
+    uint64_t one = 1;
+    if(worker.wakeup_fd != -1) {
+        ssize_t ignored = write(worker.wakeup_fd, &one, sizeof(one));
+        (void)ignored;
+    }
+}
+
+void wake_all_workers() {
+    for(auto &worker : workers) wake_worker(*worker);
+}
+
+// Serialize straight into a connection's outbound buffer: encode(buffer)
+// appends the message. Returns true if the owner must be told to flush.
+// Once the owner has closed the connection nothing is queued: encode is
+// not called, as a router still on an older registry snapshot may try.
+template<typename Encoder>
+bool enqueue_outbound(OutboundQueue &queue, Encoder &&encode) {
+    lock_guard<mutex> lock(queue.lock);
+    if(queue.closed) return false;
+    size_t before = queue.buffer.size();
+    encode(queue.buffer);
+    queue.pending_bytes.fetch_add(queue.buffer.size() - before, memory_order_relaxed);
+    if(queue.flush_scheduled) return false;
+    queue.flush_scheduled = true;
+    return true;
+}
+
+void schedule_flush(int worker_id, int fd, uint64_t conn_id) {
+    Worker &owner = *workers[worker_id];
+    {
+        lock_guard<mutex> lock(owner.flush_mutex);
+        owner.flush_list.push_back({fd, conn_id});
+    }
+    // The current worker drains its own list before its next epoll_wait
+    if(current_worker != &owner) wake_worker(owner);
+}
+
+// Hand every sender paused on queue back to its worker to read again. The
+// owner calls this after writes, and it only acts once the queue is down to
+// half the limit; closing releases them whatever is queued, for good.
+void release_blocked_senders(OutboundQueue &queue, bool closing = false) {
+    vector<PausedSender> released;
+    {
+        lock_guard<mutex> lock(queue.lock);
+        if(closing) queue.closed = true;
+        else if(queue.pending_bytes.load() > max_queued_bytes / 2) return;
+        released.swap(queue.blocked_senders);
+        queue.has_blocked_senders = false;
+    }
+    for(const PausedSender &sender : released) {
+        Worker &owner = *workers[sender.worker_id];
+        {
+            lock_guard<mutex> lock(owner.flush_mutex);
+            owner.resume_list.push_back({sender.fd, sender.conn_id});
+        }
+        if(current_worker != &owner) wake_worker(owner);
+    }
+}
+
+void count_write(Connection &conn, size_t bytes) {
+    // Sequentially consistent against pause_sender: either it sees the queue
+    // drained, or we see its sender waiting
+    conn.outbound->pending_bytes.fetch_sub(bytes);
+    if(conn.outbound->has_blocked_senders.load()) release_blocked_senders(*conn.outbound);
+    conn.outbound->write_calls.fetch_add(1, memory_order_relaxed);
+    conn.outbound->bytes_written.fetch_add(bytes, memory_order_relaxed);
+    current_worker->write_calls.fetch_add(1, memory_order_relaxed);
+    current_worker->bytes_written.fetch_add(bytes, memory_order_relaxed);
+}
+
+#ifdef NU_HAVE_IO_URING
+// io_uring completions carry the operation, the fd and the low bits of the
+// connection id, which is enough to reject a completion for a reused fd
+enum UringOp : uint64_t { URING_ACCEPT = 1, URING_RECV, URING_SEND, URING_UDP, URING_WAKEUP, URING_CANCEL };
+
+uint64_t uring_tag(UringOp op, int fd = 0, uint64_t conn_id = 0) {
+    return (uint64_t)op << 56 | (uint64_t)(fd & 0xFFFFFF) << 32 | (uint32_t)conn_id;
+}
+
+io_uring_sqe *uring_sqe(Worker &worker, uint64_t tag) {
+    io_uring_sqe *sqe = worker.uring->get_sqe(tag);
+    if(sqe == nullptr) log_event(LOG_ERROR, "io_uring submission queue full");
+    return sqe;
+}
+
+// io_uring counterpart of the send loop in flush_connection: one send per
+// connection is in flight and its completion queues the next, so the stream
+// stays in order and whatever is queued meanwhile goes out in one piece.
+// Once the server is stopping nothing new is submitted: what is left goes
+// to the spool, or to the successor with the socket.
+bool uring_flush(Connection &conn) {
+    if(conn.send_in_flight || !server_running) return true;
+    {
+        lock_guard<mutex> lock(conn.outbound->lock);
+        if(conn.send_offset == conn.sending.size()) {
+            conn.sending.clear();
+            conn.send_offset = 0;
+            conn.sending.swap(conn.outbound->buffer);
+        } else {
+            conn.sending += conn.outbound->buffer;
+            conn.outbound->buffer.clear();
+        }
+        conn.outbound->flush_scheduled = false;
+    }
+    if(conn.send_offset == conn.sending.size()) return true;
+    
+    io_uring_sqe *sqe = uring_sqe(*current_worker, uring_tag(URING_SEND, conn.fd, conn.id));
+    if(sqe == nullptr) return false;
+    prep_send(sqe, conn.fd, conn.sending.data() + conn.send_offset, conn.sending.size() - conn.send_offset);
+    conn.send_in_flight = true;
+    conn.send_started_ns = monotonic_ns();
+    return true;
+}
+#endif
+
+// Move queued frames to the socket until it would block; the rest waits for
+// EPOLLOUT. Bytes left over from a blocked write stay in sending and newer
+// ones wait behind them in staged, so one sendmsg gathers both without
+// copying. Only ever called by the worker that owns the connection.
+bool flush_connection(Connection &conn) {
+#ifdef NU_HAVE_IO_URING
+    if(io_backend == IoBackend::IO_URING) return uring_flush(conn);
+#endif
+    {
+        lock_guard<mutex> lock(conn.outbound->lock);
+        string &queued = conn.outbound->buffer;
+        if(conn.send_offset == conn.sending.size()) {
+            // Nothing left over: swap buffers so both keep their capacity
+            conn.sending.clear();
+            conn.send_offset = 0;
+            conn.sending.swap(queued);
+        } else if(conn.staged.empty()) {
+            conn.staged.swap(queued);
+        } else {
+            conn.staged += queued;
+            queued.clear();
+        }
+        conn.outbound->flush_scheduled = false;
+    }
+    
+    while(conn.send_offset < conn.sending.size()) {
+        iovec parts[2] = {
+            {conn.sending.data() + conn.send_offset, conn.sending.size() - conn.send_offset},
+            {conn.staged.data(), conn.staged.size()}
+        };
+        msghdr message{};
+        message.msg_iov = parts;
+        message.msg_iovlen = conn.staged.empty() ? 1 : 2;
         
-        string key = token.substr(0, colon_pos);
-        string value = token.substr(colon_pos + 1);
+        int64_t started = monotonic_ns();
+        ssize_t n = sendmsg(conn.fd, &message, MSG_NOSIGNAL);
+        record_stage(STAGE_SEND, started);
+        if(n > 0) {
+            count_write(conn, n);
+            if((size_t)n < parts[0].iov_len) {
+                conn.send_offset += n;
+            } else {
+                // sending is done; staged (possibly partly written) takes its place
+                conn.sending.clear();
+                conn.sending.swap(conn.staged);
+                conn.send_offset = n - parts[0].iov_len;
+            }
+        } else if(n < 0 && errno == EINTR) {
+            continue;
+        } else if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return false;
+        }
+    }
+    
+    // Keep capacity for the steady state, but give back what a burst grew
+    if(conn.send_offset == conn.sending.size() && conn.sending.capacity() > MAX_RETAINED_BUFFER) {
+        string().swap(conn.sending);
+        conn.send_offset = 0;
+    }
+    if(conn.staged.empty() && conn.staged.capacity() > MAX_RETAINED_BUFFER) string().swap(conn.staged);
+    return true;
+}
+
+bool send_tcp_message(Connection &conn, string_view message) {
+    enqueue_outbound(*conn.outbound, [&](string &out) {
+        out.append(message.data(), message.size());
+        out += '\n';
+    });
+    return flush_connection(conn);
+}
+
+// A message body as the sender framed it. Compressed bodies are relayed
+// untouched; receivers that cannot read them get a copy inflated here, once
+// per message however many of them there are. A message id (FRAME_FLAG_ID)
+// stays in front of the body for receivers that acknowledge and is cut off
+// for the rest.
+struct RoutedPayload {
+    string_view bytes;
+    uint16_t flags = 0;         // FrameFlag bits of the sender's frame
+    string inflated;            // Id, if any, then the inflated body
+    int inflate_result = 0;     // 0 = not tried, 1 = inflated, -1 = undecodable
+    size_t unacknowledged = 0;  // Receivers given the message without its id
+    size_t shed = 0;            // Receivers it was dropped for (shed-newest)
+    
+    RoutedPayload(string_view bytes, uint16_t flags = 0) : bytes(bytes), flags(flags) {}
+    
+    // The bytes and flags to send a receiver reading accepted_flags encodings;
+    // false if the payload cannot be turned into something it reads
+    bool for_receiver(uint16_t accepted_flags, string_view &body, uint16_t &body_flags) {
+        bool has_id = flags & FRAME_FLAG_ID;
+        bool keep_id = has_id && (accepted_flags & FRAME_FLAG_ID);
+        size_t id_size = has_id ? MESSAGE_ID_SIZE : 0;
+        if(has_id && !keep_id) unacknowledged++;
         
-        if(key == "Campus") campus_name = value;
-        else if(key == "Pass") password = value;
-        else if(key == "Dept") department = value;
+        if((flags & ~accepted_flags & ~FRAME_FLAG_ID) == 0) {
+            body = keep_id ? bytes : bytes.substr(id_size);
+            body_flags = keep_id ? flags : flags & ~FRAME_FLAG_ID;
+            return true;
+        }
+        if(inflate_result == 0) {
+            bool needs_dictionary = flags & FRAME_FLAG_DICTIONARY;
+            const string *dictionary = needs_dictionary ? &compress_dictionary : nullptr;
+            string text;
+            bool ok = inflate_payload(text, bytes.substr(id_size), dictionary, MAX_PAYLOAD_SIZE);
+            inflated.assign(bytes.data(), id_size);
+            inflated += text;
+            inflate_result = ok ? 1 : -1;
+        }
+        body = keep_id ? string_view(inflated) : string_view(inflated).substr(id_size);
+        body_flags = keep_id ? FRAME_FLAG_ID : 0;
+        return inflate_result == 1;
+    }
+};
+
+// Routing is only a registry lookup plus an enqueue; the worker owning the
+// target socket writes it out, so a slow campus cannot stall anyone else.
+// Each target gets a message in the protocol it negotiated
+void encode_delivery(string &out, int proto, string_view source_campus, string_view source_dept,
+                     string_view message_text, uint16_t flags = 0) {
+    if(proto == PROTO_VERSION) {
+        encode_frame(out, FRAME_DELIVER, source_campus, source_dept, message_text, flags);
+    } else {
+        out += "FROM:";
+        out.append(source_campus.data(), source_campus.size()) += ':';
+        out.append(source_dept.data(), source_dept.size()) += ':';
+        out.append(message_text.data(), message_text.size()) += '\n';
+    }
+}
+
+// One frame or line of an outbound queue, as encode_delivery and the replies
+// wrote it. Only deliveries are messages; the views point into the queue.
+struct QueuedItem {
+    size_t size = 0;
+    bool is_message = false;
+    string_view source_campus;
+    string_view source_dept;
+    string_view text;
+    uint16_t flags = 0;
+};
+
+// Parse the item at offset of bytes queued for a proto connection; false if
+// it is incomplete
+bool read_queued_item(const string &bytes, size_t offset, int proto, QueuedItem &item) {
+    const char *data = bytes.data() + offset;
+    size_t available = bytes.size() - offset;
+    item = QueuedItem();
+    
+    if(proto == PROTO_VERSION) {
+        FrameView frame;
+        if(decode_frame(data, available, frame, item.size) != FrameStatus::OK) return false;
+        item.is_message = frame.type == FRAME_DELIVER;
+        item.source_campus = frame.campus;
+        item.source_dept = frame.department;
+        item.text = frame.payload;
+        item.flags = frame.flags;
+        return true;
+    }
+    // FROM:<campus>:<dept>:<text>; other lines are replies
+    const char *newline = (const char*)memchr(data, '\n', available);
+    if(newline == nullptr) return false;
+    string_view line(data, newline - data);
+    item.size = line.size() + 1;
+    size_t first_colon = line.find(':', 5);
+    size_t second_colon = line.find(':', first_colon + 1);
+    if(line.substr(0, 5) == "FROM:" && second_colon != string_view::npos) {
+        item.is_message = true;
+        item.source_campus = line.substr(5, first_colon - 5);
+        item.source_dept = line.substr(first_colon + 1, second_colon - first_colon - 1);
+        item.text = line.substr(second_colon + 1);
+    }
+    return true;
+}
+
+// ---- Store-and-forward spool ----
+// A message for a campus department that is not connected is appended to
+// that campus's log of memory-mapped segments and replayed, in order, when a
+// matching department authenticates. A background thread msyncs dirty
+// segments in groups, and segments whose records have all been handed to a
+// connection are deleted. Spooling is the rare path, so one mutex guards it.
+//
+// Record layout (host byte order, segments never leave this machine):
+//   0   4   record length, header included; 0 marks the end of the segment
+//   4   4   FNV-1a checksum of the body
+//   8   1   SpoolState
+//   9   3   target department, source campus, source department lengths
+//   12  2   FrameFlag bits of the text (compressed messages stay compressed)
+//   14  2   reserved
+//   16  ... target department, source campus, source department, text
+
+enum SpoolState : uint8_t { SPOOL_PENDING = 1, SPOOL_DELIVERED = 2 };
+
+struct SpoolSegment {
+    uint64_t sequence = 0;
+    int fd = -1;
+    char *base = nullptr;
+    size_t used = 0;            // Bytes of records written
+    size_t pending = 0;         // Records not yet delivered
+    size_t dirty_from = SIZE_MAX;   // Byte range awaiting msync
+    size_t dirty_to = 0;
+};
+
+struct SpoolRecordView {
+    SpoolState state;
+    string_view target_dept;
+    string_view source_campus;
+    string_view source_dept;
+    string_view text;
+    uint16_t flags;
+};
+
+string spool_dir = "spool";
+mutex spool_mutex;
+condition_variable spool_wakeup;
+vector<vector<SpoolSegment>> spools;    // By campus id, oldest segment first
+uint64_t next_segment_sequence = 1;
+size_t unsynced_records = 0;
+bool spool_running = false;
+thread spool_thread;
+
+uint32_t spool_checksum(const char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for(size_t i = 0; i < length; i++) hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    return hash;
+}
+
+string segment_path(int campus, uint64_t sequence) {
+    char name[32];
+    snprintf(name, sizeof(name), "-%012llu.seg", (unsigned long long)sequence);
+    return spool_dir + "/" + campus_names[campus] + name;
+}
+
+// Decode the record at offset; false at the end of the written records or
+// at a torn write, which ends the segment
+bool read_spool_record(const SpoolSegment &segment, size_t offset, SpoolRecordView &record,
+                       size_t &record_size) {
+    if(offset + SPOOL_RECORD_HEADER > SPOOL_SEGMENT_SIZE) return false;
+    const char *header = segment.base + offset;
+    uint32_t length, checksum;
+    memcpy(&length, header, 4);
+    memcpy(&checksum, header + 4, 4);
+    size_t dept_len = (uint8_t)header[9], campus_len = (uint8_t)header[10];
+    size_t source_dept_len = (uint8_t)header[11];
+    
+    if(length < SPOOL_RECORD_HEADER + dept_len + campus_len + source_dept_len ||
+       length > SPOOL_SEGMENT_SIZE - offset) {
+        return false;
+    }
+    const char *body = header + SPOOL_RECORD_HEADER;
+    if(spool_checksum(body, length - SPOOL_RECORD_HEADER) != checksum) return false;
+    
+    record.state = (SpoolState)header[8];
+    memcpy(&record.flags, header + 12, 2);
+    record.target_dept = string_view(body, dept_len);
+    record.source_campus = string_view(body + dept_len, campus_len);
+    record.source_dept = string_view(body + dept_len + campus_len, source_dept_len);
+    size_t names = dept_len + campus_len + source_dept_len;
+    record.text = string_view(body + names, length - SPOOL_RECORD_HEADER - names);
+    record_size = length;
+    return true;
+}
+
+bool map_segment(SpoolSegment &segment, int campus, bool create) {
+    string path = segment_path(campus, segment.sequence);
+    segment.fd = open(path.c_str(), O_RDWR | O_CLOEXEC | (create ? O_CREAT | O_EXCL : 0), 0600);
+    if(segment.fd < 0) {
+        log_event(LOG_ERROR, "Spool: cannot open %s: %s", path.c_str(), strerror(errno));
+        return false;
+    }
+    // A fresh file reads as zeros, which is the end-of-segment marker. Its
+    // blocks are allocated now: a store into a page of a sparse file the
+    // disk has no room for would raise SIGBUS instead of failing here.
+    int error = create ? posix_fallocate(segment.fd, 0, SPOOL_SEGMENT_SIZE) : 0;
+    if(error != 0) {
+        log_event(LOG_ERROR, "Spool: cannot allocate %s (spool full?): %s", path.c_str(), strerror(error));
+        close(segment.fd);
+        unlink(path.c_str());
+        return false;
+    }
+    void *base = mmap(nullptr, SPOOL_SEGMENT_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, segment.fd, 0);
+    if(base == MAP_FAILED) {
+        log_event(LOG_ERROR, "Spool: cannot map %s: %s", path.c_str(), strerror(errno));
+        close(segment.fd);
+        if(create) unlink(path.c_str());
+        return false;
+    }
+    segment.base = (char*)base;
+    return true;
+}
+
+void release_segment(SpoolSegment &segment, int campus, bool remove) {
+    munmap(segment.base, SPOOL_SEGMENT_SIZE);
+    close(segment.fd);
+    if(remove) unlink(segment_path(campus, segment.sequence).c_str());
+}
+
+void mark_dirty(SpoolSegment &segment, size_t from, size_t to) {
+    segment.dirty_from = min(segment.dirty_from, from);
+    segment.dirty_to = max(segment.dirty_to, to);
+}
+
+// Caller holds spool_mutex
+bool spool_append(int campus, string_view target_dept, string_view source_campus,
+                  string_view source_dept, string_view text, uint16_t flags) {
+    if(target_dept.size() > 255 || source_campus.size() > 255 || source_dept.size() > 255) return false;
+    size_t length = SPOOL_RECORD_HEADER + target_dept.size() + source_campus.size() +
+                    source_dept.size() + text.size();
+    if(length > SPOOL_SEGMENT_SIZE) return false;
+    
+    auto &segments = spools[campus];
+    if(segments.empty() || segments.back().used + length > SPOOL_SEGMENT_SIZE) {
+        SpoolSegment segment;
+        segment.sequence = next_segment_sequence++;
+        if(!map_segment(segment, campus, true)) return false;
+        segments.push_back(segment);
+    }
+    SpoolSegment &segment = segments.back();
+    
+    // Body first, header last: a torn record fails its checksum on recovery
+    char *record = segment.base + segment.used;
+    char *body = record + SPOOL_RECORD_HEADER;
+    size_t offset = 0;
+    for(string_view part : {target_dept, source_campus, source_dept, text}) {
+        memcpy(body + offset, part.data(), part.size());
+        offset += part.size();
+    }
+    uint32_t record_length = (uint32_t)length;
+    uint32_t checksum = spool_checksum(body, offset);
+    memcpy(record + 4, &checksum, 4);
+    record[8] = SPOOL_PENDING;
+    record[9] = (char)target_dept.size();
+    record[10] = (char)source_campus.size();
+    record[11] = (char)source_dept.size();
+    memcpy(record + 12, &flags, 2);
+    memcpy(record, &record_length, 4);
+    
+    mark_dirty(segment, segment.used, segment.used + length);
+    segment.used += length;
+    segment.pending++;
+    if(++unsynced_records >= SPOOL_SYNC_BATCH) spool_wakeup.notify_one();
+    return true;
+}
+
+// Delete every segment with nothing left to deliver. Caller holds spool_mutex.
+void compact_spool(int campus) {
+    auto &segments = spools[campus];
+    auto done = [](const SpoolSegment &segment) { return segment.pending == 0; };
+    for(auto &segment : segments) {
+        if(done(segment)) release_segment(segment, campus, true);
+    }
+    segments.erase(remove_if(segments.begin(), segments.end(), done), segments.end());
+}
+
+// Queue every spooled message addressed to conn's department, oldest first,
+// and mark it delivered. Called during auth, before conn is routable, with
+// spool_mutex held so no concurrent router can spool behind the replay.
+size_t replay_spool(Connection &conn) {
+    size_t replayed = 0;
+    for(auto &segment : spools[conn.campus_id]) {
+        SpoolRecordView record;
+        size_t record_size;
+        for(size_t offset = 0; offset < segment.used; offset += record_size) {
+            if(!read_spool_record(segment, offset, record, record_size)) break;
+            if(record.state != SPOOL_PENDING || record.target_dept != conn.department) continue;
+            RoutedPayload payload(record.text, record.flags);
+            string_view body;
+            uint16_t body_flags;
+            if(payload.for_receiver(conn.frame_flags, body, body_flags)) {
+                enqueue_outbound(*conn.outbound, [&](string &out) {
+                    encode_delivery(out, conn.proto, record.source_campus, record.source_dept, body, body_flags);
+                });
+            } else {
+                log_event(LOG_WARN, "Dropping undecodable spooled message from %.*s:%.*s",
+                          (int)record.source_campus.size(), record.source_campus.data(),
+                          (int)record.source_dept.size(), record.source_dept.data());
+            }
+            segment.base[offset + 8] = SPOOL_DELIVERED;
+            mark_dirty(segment, offset, offset + SPOOL_RECORD_HEADER);
+            segment.pending--;
+            replayed++;
+        }
+    }
+    compact_spool(conn.campus_id);
+    return replayed;
+}
+
+// Caller holds spool_mutex
+void sync_spool() {
+    long page = sysconf(_SC_PAGESIZE);
+    for(auto &segments : spools) {
+        for(auto &segment : segments) {
+            if(segment.dirty_from >= segment.dirty_to) continue;
+            size_t from = segment.dirty_from / page * page;
+            if(msync(segment.base + from, segment.dirty_to - from, MS_SYNC) < 0) {
+                log_event(LOG_ERROR, "Spool: msync failed: %s", strerror(errno));
+            }
+            segment.dirty_from = SIZE_MAX;
+            segment.dirty_to = 0;
+        }
+    }
+    unsynced_records = 0;
+}
+
+// Group commit: one msync pass covers every record spooled since the last
+// pass, at most SPOOL_SYNC_INTERVAL_MS or SPOOL_SYNC_BATCH records later
+void spool_sync_loop() {
+    unique_lock<mutex> lock(spool_mutex);
+    while(spool_running) {
+        spool_wakeup.wait_for(lock, chrono::milliseconds(SPOOL_SYNC_INTERVAL_MS), [] {
+            return !spool_running || unsynced_records >= SPOOL_SYNC_BATCH;
+        });
+        sync_spool();
+    }
+}
+
+// Map the segments a previous run left behind and start the sync thread
+bool start_spool() {
+    spools.assign(campus_names.size(), {});
+    if(mkdir(spool_dir.c_str(), 0700) < 0 && errno != EEXIST) {
+        log_event(LOG_ERROR, "Spool: cannot create %s: %s", spool_dir.c_str(), strerror(errno));
+        return false;
+    }
+    DIR *dir = opendir(spool_dir.c_str());
+    if(dir == nullptr) {
+        log_event(LOG_ERROR, "Spool: cannot open %s: %s", spool_dir.c_str(), strerror(errno));
+        return false;
+    }
+    
+    size_t recovered = 0;
+    while(dirent *entry = readdir(dir)) {
+        string name = entry->d_name;
+        size_t dash = name.rfind('-');
+        if(dash == string::npos || name.size() < 4 || name.compare(name.size() - 4, 4, ".seg") != 0) continue;
+        int campus = campus_id(string_view(name).substr(0, dash));
+        if(campus < 0) continue;
+        
+        SpoolSegment segment;
+        segment.sequence = strtoull(name.c_str() + dash + 1, nullptr, 10);
+        if(!map_segment(segment, campus, false)) continue;
+        SpoolRecordView record;
+        size_t record_size;
+        while(read_spool_record(segment, segment.used, record, record_size)) {
+            if(record.state == SPOOL_PENDING) segment.pending++;
+            segment.used += record_size;
+        }
+        recovered += segment.pending;
+        next_segment_sequence = max(next_segment_sequence, segment.sequence + 1);
+        spools[campus].push_back(segment);
+    }
+    closedir(dir);
+    
+    for(size_t campus = 0; campus < spools.size(); campus++) {
+        sort(spools[campus].begin(), spools[campus].end(),
+             [](const SpoolSegment &a, const SpoolSegment &b) { return a.sequence < b.sequence; });
+        compact_spool((int)campus);
+    }
+    if(recovered > 0) log_event(LOG_INFO, "Spool: %zu undelivered message(s) recovered", recovered);
+    
+    spool_running = true;
+    spool_thread = thread(spool_sync_loop);
+    return true;
+}
+
+void stop_spool() {
+    {
+        lock_guard<mutex> lock(spool_mutex);
+        if(!spool_running) return;
+        spool_running = false;
+    }
+    spool_wakeup.notify_one();
+    spool_thread.join();
+    
+    lock_guard<mutex> lock(spool_mutex);
+    sync_spool();
+    for(size_t campus = 0; campus < spools.size(); campus++) {
+        for(auto &segment : spools[campus]) release_segment(segment, (int)campus, false);
+        spools[campus].clear();
+    }
+}
+
+// Find the precomputed fan-out list for campus:dept. Either side may be
+// "*"; an empty department means the whole campus.
+TargetList resolve_targets(const RegistrySnapshot &snapshot, string_view campus, string_view dept) {
+    bool any_campus = campus == "*";
+    bool any_dept = dept.empty() || dept == "*";
+    const vector<const SubscriptionGroup*> *list = nullptr;
+    
+    if(any_campus && any_dept) {
+        list = &snapshot.everyone;
+    } else if(any_campus) {
+        auto it = snapshot.by_department.find(dept);
+        if(it != snapshot.by_department.end()) list = &it->second;
+    } else {
+        int id = campus_id(campus);
+        if(id < 0) return {};
+        if(any_dept) {
+            list = &snapshot.by_campus[id];
+        } else {
+            auto it = snapshot.by_address.find({id, dept});
+            if(it != snapshot.by_address.end()) return {&it->second, nullptr, 1};
+        }
+    }
+    if(list == nullptr) return {};
+    return {nullptr, list->data(), list->size()};
+}
+
+// Pick the connection of a group that should get the next message under
+// ROUND_ROBIN or LEAST_QUEUED; the sender itself only when it is the only
+// member. The scan starts at the round-robin cursor so least-queued ties
+// are spread as well.
+const ClientInfo *pick_member(const SubscriptionGroup &group, uint64_t source_conn) {
+    const auto &members = group.members;
+    if(members.size() == 1) return members[0];
+    uint32_t start = group.next_member.fetch_add(1, memory_order_relaxed);
+    const ClientInfo *chosen = nullptr;
+    size_t fewest = SIZE_MAX;
+    
+    for(size_t k = 0; k < members.size(); k++) {
+        const ClientInfo *member = members[(start + k) % members.size()];
+        if(member->conn_id == source_conn) continue;
+        if(delivery_mode == DeliveryMode::ROUND_ROBIN) return member;
+        
+        size_t pending = member->outbound->pending_bytes.load(memory_order_relaxed);
+        if(pending < fewest) {
+            fewest = pending;
+            chosen = member;
+        }
+    }
+    return chosen;
+}
+
+// Queue a FRAME_ACK from from_campus:from_dept for every ack-capable terminal
+// of the department that sent the message. Only the terminal that issued the
+// id knows it, so all of them get a copy.
+void relay_ack(string_view to_campus, string_view to_dept, string_view from_campus, string_view from_dept,
+               string_view ack_payload) {
+    RegistryReader registry_view;
+    TargetList targets = resolve_targets(*registry_view, to_campus, to_dept);
+    for(size_t i = 0; i < targets.count; i++) {
+        for(const ClientInfo *member : targets[i]->members) {
+            if(!(member->frame_flags & FRAME_FLAG_ID)) continue;
+            bool needs_flush = enqueue_outbound(*member->outbound, [&](string &out) {
+                encode_frame(out, FRAME_ACK, from_campus, from_dept, ack_payload);
+            });
+            if(needs_flush) schedule_flush(member->worker_id, member->tcp_sock, member->conn_id);
+        }
+    }
+}
+
+// ---- Slow consumers ----
+// Every connection's outbound queue is bounded by --max-queued-bytes. A
+// message that finds its target's queue at the limit is handled by
+// --slow-consumer, and the sender is told (FRAME_THROTTLE, or a THROTTLED
+// line), so one campus that reads slowly holds back only those sending to it.
+
+// At most one notice per sender every THROTTLE_NOTICE_INTERVAL_MS
+void send_throttle_notice(Connection &source, const ClientInfo &target, ThrottleAction action) {
+    int64_t now = monotonic_ms();
+    if(source.throttle_notice_ms != 0 && now - source.throttle_notice_ms < THROTTLE_NOTICE_INTERVAL_MS) return;
+    source.throttle_notice_ms = now;
+    count_metric(METRIC_THROTTLE_NOTICES);
+    bool needs_flush = enqueue_outbound(*source.outbound, [&](string &out) {
+        if(source.proto == PROTO_VERSION) {
+            encode_throttle_frame(out, target.campus, target.department, action);
+        } else {
+            out += "THROTTLED:" + target.campus + ":" + target.department + ":" + throttle_action_name(action) + "\n";
+        }
+    });
+    if(needs_flush) schedule_flush(current_worker->id, source.fd, source.id);
+}
+
+// Wait on queue until its owner drains it to half the limit. False if it
+// already has (or was closed), so there is nothing to wait for.
+bool pause_sender(const Connection &source, OutboundQueue &queue) {
+    lock_guard<mutex> lock(queue.lock);
+    // Sequentially consistent against count_write, see there
+    queue.has_blocked_senders = true;
+    if(queue.closed || queue.pending_bytes.load() <= max_queued_bytes / 2) return false;
+    queue.blocked_senders.push_back({current_worker->id, source.fd, source.id});
+    return true;
+}
+
+// Drop the oldest messages waiting for target until its queue is back to
+// half the limit. Replies, credits and acks stay, and so do bytes the owner
+// has already taken to write. Senders that asked for acks hear theirs failed.
+void shed_oldest(const ClientInfo &target) {
+    struct ShedMessage {
+        string campus;
+        string department;
+        uint64_t id;
+    };
+    vector<ShedMessage> failed;
+    size_t shed = 0;
+    {
+        OutboundQueue &queue = *target.outbound;
+        lock_guard<mutex> lock(queue.lock);
+        size_t pending = queue.pending_bytes.load(memory_order_relaxed);
+        if(pending <= max_queued_bytes / 2) return;
+        size_t excess = pending - max_queued_bytes / 2;
+        
+        string kept;
+        size_t offset = 0, freed = 0;
+        QueuedItem item;
+        while(freed < excess && offset < queue.buffer.size() &&
+              read_queued_item(queue.buffer, offset, target.proto, item)) {
+            if(item.is_message) {
+                freed += item.size;
+                shed++;
+                if((item.flags & FRAME_FLAG_ID) && item.text.size() >= MESSAGE_ID_SIZE) {
+                    failed.push_back({string(item.source_campus), string(item.source_dept),
+                                      read_message_id(item.text)});
+                }
+            } else {
+                kept.append(queue.buffer, offset, item.size);
+            }
+            offset += item.size;
+        }
+        kept.append(queue.buffer, offset, string::npos);
+        queue.buffer.swap(kept);
+        queue.pending_bytes.fetch_sub(freed);
+    }
+    count_metric(METRIC_MESSAGES_SHED_OLDEST, shed);
+    for(const ShedMessage &message : failed) {
+        string ack;
+        append_message_id(ack, message.id);
+        ack += (char)ACK_FAILED;
+        relay_ack(message.campus, message.department, target.campus, target.department, ack);
+    }
+}
+
+// A message from source meets target's full queue. Returns whether it should
+// still be queued there.
+bool admit_to_full_queue(Connection &source, const ClientInfo &target) {
+    switch(slow_consumer_policy) {
+    case SlowConsumerPolicy::BLOCK:
+        // The sender finishes the message it is on (other targets included)
+        // and reads no further; no credit goes back meanwhile
+        if(pause_sender(source, *target.outbound) && !source.paused) {
+            source.paused = true;
+            source.paused_ns = monotonic_ns();
+            paused_senders++;
+            count_metric(METRIC_SENDERS_BLOCKED);
+            send_throttle_notice(source, target, THROTTLE_BLOCKED);
+        }
+        return true;
+    case SlowConsumerPolicy::SHED_OLDEST:
+        shed_oldest(target);
+        send_throttle_notice(source, target, THROTTLE_SHED_OLDEST);
+        return true;
+    case SlowConsumerPolicy::SHED_NEWEST:
+        count_metric(METRIC_MESSAGES_SHED_NEWEST);
+        send_throttle_notice(source, target, THROTTLE_SHED_NEWEST);
+        return false;
+    case SlowConsumerPolicy::DISCONNECT:
+        // The owner closes it on its next flush; the message is spooled with the rest
+        if(!target.outbound->overflowed.exchange(true)) {
+            schedule_flush(target.worker_id, target.tcp_sock, target.conn_id);
+        }
+        send_throttle_notice(source, target, THROTTLE_DISCONNECTED);
+        return true;
+    }
+    return true;
+}
+
+// Queue the message for the subscribers of target_campus:target_dept (all of
+// them, or one per group, depending on delivery_mode). The sender is left
+// out of its own group unless it is the only member, which gets its own
+// message back as a lone terminal always has.
+// Returns the number of connections it was queued for.
+size_t deliver_message(Connection &source, string_view target_campus,
+                       string_view target_dept, RoutedPayload &payload) {
+    RegistryReader registry_view;
+    TargetList targets = resolve_targets(*registry_view, target_campus, target_dept);
+    
+    size_t delivered = 0;
+    auto deliver = [&](const ClientInfo *target) {
+        string_view body;
+        uint16_t body_flags;
+        size_t unacknowledged = payload.unacknowledged;
+        if(!payload.for_receiver(target->frame_flags, body, body_flags)) return;
+        if(max_queued_bytes > 0 && target->outbound->pending_bytes.load(memory_order_relaxed) >= max_queued_bytes &&
+           !admit_to_full_queue(source, *target)) {
+            payload.shed++;
+            return;
+        }
+        bool queued = false;
+        bool needs_flush = enqueue_outbound(*target->outbound, [&](string &out) {
+            encode_delivery(out, target->proto, source.campus, source.department, body, body_flags);
+            queued = true;
+        });
+        // Closed since our snapshot: not a delivery, so the caller may spool it
+        if(!queued) {
+            payload.unacknowledged = unacknowledged;
+            return;
+        }
+        if(needs_flush) schedule_flush(target->worker_id, target->tcp_sock, target->conn_id);
+        delivered++;
+    };
+    
+    for(size_t i = 0; i < targets.count; i++) {
+        const SubscriptionGroup &group = *targets[i];
+        if(delivery_mode == DeliveryMode::FANOUT) {
+            for(const ClientInfo *member : group.members) {
+                if(member->conn_id != source.id || group.members.size() == 1) deliver(member);
+            }
+        } else if(const ClientInfo *member = pick_member(group, source.id)) {
+            deliver(member);
+        }
+    }
+    return delivered;
+}
+
+// Tell the sender of a message with an id what the server did with it. The
+// ack names the target as the sender addressed it.
+void send_server_ack(const Connection &source, string_view target_campus, string_view target_dept,
+                     const RoutedPayload &payload, AckStatus status) {
+    if(!(payload.flags & FRAME_FLAG_ID)) return;
+    bool needs_flush = enqueue_outbound(*source.outbound, [&](string &out) {
+        encode_ack_frame(out, target_campus, target_dept, read_message_id(payload.bytes), status);
+    });
+    if(needs_flush) schedule_flush(current_worker->id, source.fd, source.id);
+}
+
+// Deliver now, or spool the message when a named department of a named
+// campus is not connected. A record is replayed once, to the department it
+// names, so Campus:* and a bare campus are not spooled: nothing says which
+// of its departments would still be owed a copy.
+void route_campus_message(Connection &source, string_view target_campus,
+                          string_view target_dept, string_view message_text, uint16_t flags = 0) {
+    RoutedPayload payload(message_text, flags);
+    size_t delivered = deliver_message(source, target_campus, target_dept, payload);
+    
+    int target_id = target_dept.empty() || target_dept == "*" ? -1 : campus_id(target_campus);
+    if(delivered == 0 && payload.shed == 0 && target_id >= 0) {
+        lock_guard<mutex> lock(spool_mutex);
+        // The target may have authenticated meanwhile; its replay ran under this lock
+        delivered = deliver_message(source, target_campus, target_dept, payload);
+        if(delivered == 0 && payload.shed == 0 && spool_append(target_id, target_dept, source.campus, source.department,
+                                          message_text, flags)) {
+            log_event(LOG_INFO, "Message from %s:%s spooled for offline %.*s:%.*s",
+                      source.campus.c_str(), source.department.c_str(),
+                      (int)target_campus.size(), target_campus.data(),
+                      (int)target_dept.size(), target_dept.data());
+            count_metric(METRIC_MESSAGES_SPOOLED);
+            send_server_ack(source, target_campus, target_dept, payload, ACK_SPOOLED);
+            return;
+        }
+    }
+    
+    if(delivered == 0 && payload.shed > 0) {
+        log_event(LOG_DEBUG, "Message from %s:%s shed: %.*s:%.*s is reading slowly",
+                  source.campus.c_str(), source.department.c_str(),
+                  (int)target_campus.size(), target_campus.data(),
+                  (int)target_dept.size(), target_dept.data());
+        send_server_ack(source, target_campus, target_dept, payload, ACK_FAILED);
+        return;
+    }
+    if(delivered == 0) count_metric(METRIC_MESSAGES_UNROUTABLE);
+    if(delivered == 0 && payload.inflate_result < 0) {
+        log_event(LOG_WARN, "Routing failed: undecodable compressed message from %s:%s",
+                  source.campus.c_str(), source.department.c_str());
+        send_server_ack(source, target_campus, target_dept, payload, ACK_FAILED);
+        return;
+    }
+    if(delivered == 0) {
+        log_event(LOG_WARN, "Routing failed: no campus department subscribed to '%.*s:%.*s'.",
+                  (int)target_campus.size(), target_campus.data(),
+                  (int)target_dept.size(), target_dept.data());
+        send_server_ack(source, target_campus, target_dept, payload, ACK_FAILED);
+        return;
+    }
+    log_event(LOG_INFO, "Message routed from %s:%s to %.*s:%.*s (%zu recipient%s)",
+              source.campus.c_str(), source.department.c_str(),
+              (int)target_campus.size(), target_campus.data(),
+              (int)target_dept.size(), target_dept.data(), delivered, delivered == 1 ? "" : "s");
+    count_metric(METRIC_MESSAGES_ROUTED);
+    count_metric(METRIC_DELIVERIES, delivered);
+    // Receivers with acks answer for themselves
+    if(payload.unacknowledged > 0) send_server_ack(source, target_campus, target_dept, payload, ACK_FORWARDED);
+}
+
+// Pass a receiver's FRAME_ACK back to the department that sent the message,
+// renamed to the receiver
+void route_ack(const Connection &conn, const FrameView &frame) {
+    uint64_t id;
+    uint8_t status;
+    if(!decode_ack(frame.payload, id, status) || frame.department.empty() ||
+       frame.campus == "*" || frame.department == "*") {
+        return;
+    }
+    count_metric(METRIC_ACKS_RELAYED);
+    relay_ack(frame.campus, frame.department, conn.campus, conn.department, frame.payload);
+}
+
+void close_connection(int fd);
+
+// Flush every connection of this worker that gained outbound frames; one
+// that overflowed under the disconnect policy is closed instead
+void flush_or_close(Connection &conn) {
+    if(conn.outbound->overflowed.load(memory_order_relaxed)) {
+        log_event(LOG_WARN, "Disconnecting slow consumer %s:%s with %zu bytes queued", conn.campus.c_str(),
+                  conn.department.c_str(), conn.outbound->pending_bytes.load(memory_order_relaxed));
+        count_metric(METRIC_SLOW_CONSUMERS_DISCONNECTED);
+        shutdown(conn.fd, SHUT_RDWR);
+        close_connection(conn.fd);
+        return;
+    }
+    if(!flush_connection(conn)) {
+        log_event(LOG_WARN, "Failed to send message to %s", conn.campus.c_str());
+        close_connection(conn.fd);
+    }
+}
+
+// Flush every connection other workers queued for. With --flush-delay-ms a
+// small backlog is deferred so later messages share its write; a backlog of
+// FLUSH_BATCH_BYTES goes out at once.
+void drain_flush_list(Worker &worker) {
+    vector<FlushRequest> pending;
+    {
+        lock_guard<mutex> lock(worker.flush_mutex);
+        pending.swap(worker.flush_list);
+    }
+    
+    for(const auto &request : pending) {
+        auto target_conn = worker.connections.find(request.fd);
+        if(target_conn == worker.connections.end() || target_conn->second.id != request.conn_id) {
+            continue;
+        }
+        Connection &conn = target_conn->second;
+        if(flush_delay_ms == 0 || conn.outbound->pending_bytes >= FLUSH_BATCH_BYTES ||
+           conn.outbound->overflowed.load(memory_order_relaxed)) {
+            flush_or_close(conn);
+        } else if(!conn.flush_deferred) {
+            conn.flush_deferred = true;
+            worker.deferred.push_back({conn.fd, conn.id, monotonic_ms() + flush_delay_ms});
+        }
+    }
+}
+
+// Write out deferred flushes whose delay has passed
+void flush_deferred(Worker &worker) {
+    if(worker.deferred.empty()) return;
+    int64_t now = monotonic_ms();
+    size_t done = 0;
+    for(; done < worker.deferred.size() && worker.deferred[done].due_ms <= now; done++) {
+        const DeferredFlush &request = worker.deferred[done];
+        auto target_conn = worker.connections.find(request.fd);
+        if(target_conn == worker.connections.end() || target_conn->second.id != request.conn_id) {
+            continue;
+        }
+        target_conn->second.flush_deferred = false;
+        flush_or_close(target_conn->second);
+    }
+    worker.deferred.erase(worker.deferred.begin(), worker.deferred.begin() + done);
+}
+
+// epoll_wait timeout: wake for the next deferred flush, else once a second
+// for the timing wheel
+int next_wait_ms(const Worker &worker) {
+    if(worker.deferred.empty()) return 1000;
+    return (int)max<int64_t>(0, min<int64_t>(1000, worker.deferred.front().due_ms - monotonic_ms()));
+}
+
+// Registry entry for an authenticated connection owned by worker_id
+shared_ptr<ClientInfo> make_registration(const Connection &conn, int worker_id) {
+    auto client_info = make_shared<ClientInfo>();
+    client_info->tcp_sock = conn.fd;
+    client_info->worker_id = worker_id;
+    client_info->conn_id = conn.id;
+    client_info->outbound = conn.outbound;
+    client_info->proto = conn.proto;
+    client_info->frame_flags = conn.frame_flags;
+    client_info->campus_id = conn.campus_id;
+    client_info->campus = conn.campus;
+    client_info->department = conn.department;
+    return client_info;
+}
+
+// Returns false when the connection must be closed
+bool handle_auth_line(Connection &conn, string_view auth_data) {
+    // Parse authentication; the views point into the line
+    string campus_name, department;
+    string_view password, proto, compression, dictionary, window, acks, session;
+    
+    while(!auth_data.empty()) {
+        size_t comma = auth_data.find(',');
+        string_view token = auth_data.substr(0, comma);
+        auth_data = comma == string_view::npos ? string_view() : auth_data.substr(comma + 1);
+        size_t colon_pos = token.find(':');
+        if(colon_pos == string_view::npos) continue;
+        
+        string_view key = token.substr(0, colon_pos);
+        string_view value = token.substr(colon_pos + 1);
+        
+        if(key == "Campus") campus_name = value;
+        else if(key == "Pass") password = value;
+        else if(key == "Dept") department = value;
+        else if(key == "Proto") proto = value;
+        else if(key == "Compress") compression = value;
+        else if(key == "Dict") dictionary = value;
+        else if(key == "Window") window = value;
+        else if(key == "Ack") acks = value;
+        else if(key == "Session") session = value;
+    }
+    
+    // A session token from an earlier AUTH_OK stands in for the credentials
+    if(!session.empty()) {
+        uint16_t session_campus;
+        if(session_ttl == 0 || !verify_session_token(session_key, session, time(nullptr), session_campus, department) ||
+           session_campus >= campus_names.size()) {
+            count_metric(METRIC_AUTH_FAILED);
+            count_metric(METRIC_SESSIONS_REJECTED);
+            send_tcp_message(conn, "AUTH_FAIL:Invalid or expired session");
+            return false;
+        }
+        count_metric(METRIC_SESSIONS_RESUMED);
+        campus_name = campus_names[session_campus];
+    } else {
+        // Validate
+        if(campus_name.empty() || password.empty()) {
+            count_metric(METRIC_AUTH_FAILED);
+            send_tcp_message(conn, "AUTH_FAIL:Missing credentials");
+            return false;
+        }
+        
+        auto valid_cred = campus_credentials.find(campus_name);
+        if(valid_cred == campus_credentials.end() || valid_cred->second != password) {
+            count_metric(METRIC_AUTH_FAILED);
+            send_tcp_message(conn, "AUTH_FAIL:Invalid credentials");
+            return false;
+        }
+    }
+    
+    // '*' is the routing wildcard and ':' separates SEND fields
+    if(department == "*" || department.find(':') != string::npos || department.size() > 255) {
+        count_metric(METRIC_AUTH_FAILED);
+        send_tcp_message(conn, "AUTH_FAIL:Invalid department");
+        return false;
+    }
+    
+    count_metric(METRIC_AUTH_SUCCEEDED);
+    conn.campus = campus_name;
+    conn.campus_id = campus_id(campus_name);
+    conn.department = department.empty() ? "General" : department;
+    conn.state = ConnState::ACTIVE;
+    if(proto == to_string(PROTO_VERSION)) conn.proto = PROTO_VERSION;
+    if(conn.proto == PROTO_VERSION && !window.empty()) {
+        conn.credit_window = (uint32_t)min<unsigned long>(strtoul(string(window).c_str(), nullptr, 10),
+                                                          MAX_CREDIT_WINDOW);
+    }
+    // Compressed payloads only travel in frames
+    if(conn.proto == PROTO_VERSION && compression == "deflate") {
+        conn.frame_flags = FRAME_FLAG_DEFLATE;
+        if(!compress_dictionary.empty() && dictionary == to_string(compress_dictionary_id)) {
+            conn.frame_flags |= FRAME_FLAG_DICTIONARY;
+        }
+    }
+    if(conn.proto == PROTO_VERSION && acks == "1") conn.frame_flags |= FRAME_FLAG_ID;
+    
+    // Register client
+    auto client_info = make_registration(conn, current_worker->id);
+    client_info->last_seen_ms = monotonic_ms();
+    conn.registration = client_info;
+    // Replaces the auth deadline
+    conn.liveness_due = current_worker->liveness.schedule(
+        {conn.fd, conn.id, current_tick() + (uint64_t)heartbeat_interval * heartbeat_misses + 1});
+    
+    server_log("Campus authenticated: " + campus_name + " (Dept: " + conn.department + ")");
+    // The reply stays a text line; both sides switch to frames after it
+    string reply = "AUTH_OK:" + campus_name;
+    if(conn.proto == PROTO_VERSION) {
+        reply += ",Proto:" + to_string(PROTO_VERSION) + ",Id:" + to_string(conn.campus_id) +
+                 ",Conn:" + to_string(conn.id);
+    }
+    if(conn.frame_flags & FRAME_FLAG_DEFLATE) {
+        reply += ",Compress:deflate";
+        if(!compress_dictionary.empty()) reply += ",Dict:" + to_string(compress_dictionary_id);
+    }
+    if(conn.credit_window > 0) reply += ",Window:" + to_string(conn.credit_window);
+    if(conn.frame_flags & FRAME_FLAG_ID) reply += ",Ack:1";
+    if(session_ttl > 0) {
+        reply += ",Session:" + issue_session_token(session_key, (uint16_t)conn.campus_id, conn.department,
+                                                   time(nullptr) + session_ttl);
+    }
+    if(!send_tcp_message(conn, reply)) return false;
+    
+    // Routable once publish_registry_changes runs at the end of the pass
+    current_worker->registrations.push_back({conn.fd, conn.id, client_info});
+    return true;
+}
+
+// Parses SEND:<campus>:<dept>:<text> in place; the views point into in_buf
+void handle_message_line(Connection &conn, string_view message) {
+    // Check if it's a SEND message
+    if(message.substr(0, 5) != "SEND:") return;
+    
+    string_view payload = message.substr(5);
+    size_t first_colon = payload.find(':');
+    size_t second_colon = payload.find(':', first_colon + 1);
+    
+    if(first_colon != string_view::npos && second_colon != string_view::npos) {
+        string_view target_campus = payload.substr(0, first_colon);
+        string_view target_dept = payload.substr(first_colon + 1, second_colon - first_colon - 1);
+        string_view message_text = payload.substr(second_colon + 1);
+        
+        if(!target_campus.empty()) {
+            route_campus_message(conn, target_campus, target_dept, message_text);
+        }
+    }
+}
+
+// Spool the messages in bytes, as queued for a proto connection of
+// campus:department, that end past start. Caller holds spool_mutex.
+size_t spool_queued(int campus, const string &department, int proto, const string &bytes, size_t start) {
+    size_t saved = 0;
+    size_t offset = 0;
+    QueuedItem item;
+    while(offset < bytes.size() && read_queued_item(bytes, offset, proto, item)) {
+        offset += item.size;
+        if(offset <= start || !item.is_message) continue;
+        if(spool_append(campus, department, item.source_campus, item.source_dept, item.text, item.flags)) saved++;
+    }
+    return saved;
+}
+
+// Put every message queued for conn but not fully written back into the
+// spool, so the department gets it when it reconnects. A partly written
+// message is spooled whole. Returns the number of messages saved.
+size_t spool_undelivered(Connection &conn) {
+    string queued;
+    {
+        // Nothing is queued after this; routers spool it themselves
+        lock_guard<mutex> lock(conn.outbound->lock);
+        queued.swap(conn.outbound->buffer);
+        conn.outbound->closed = true;
+    }
+    
+    lock_guard<mutex> lock(spool_mutex);
+    return spool_queued(conn.campus_id, conn.department, conn.proto, conn.sending, conn.send_offset) +
+           spool_queued(conn.campus_id, conn.department, conn.proto, conn.staged, 0) +
+           spool_queued(conn.campus_id, conn.department, conn.proto, queued, 0);
+}
+
+void close_connection(int fd) {
+    // Cleanup on disconnect; only unregister if the entry is still ours
+    auto conn_it = current_worker->connections.find(fd);
+    if(conn_it != current_worker->connections.end()) count_metric(METRIC_CONNECTIONS_CLOSED);
+    if(conn_it != current_worker->connections.end() && conn_it->second.state == ConnState::ACTIVE) {
+        const Connection &conn = conn_it->second;
+        // Leaves the registry with the rest of this pass's logouts
+        current_worker->removals.push_back(conn.registration);
+        server_log("Campus disconnected: " + conn.campus + " (Dept: " + conn.department + ")");
+        
+        size_t saved = spool_undelivered(conn_it->second);
+        if(saved > 0) {
+            log_event(LOG_INFO, "Spooled %zu undelivered message(s) for %s:%s", saved,
+                      conn.campus.c_str(), conn.department.c_str());
+        }
+        release_blocked_senders(*conn.outbound, true);
+        if(conn.paused) paused_senders--;
+    }
+#ifdef NU_HAVE_IO_URING
+    if(io_backend == IoBackend::IO_URING) {
+        // Shutting down reads ends the multishot receive. A send still in
+        // flight keeps its connection (buffer and descriptor) until it
+        // completes, so a final AUTH_FAIL still reaches the peer.
+        shutdown(fd, SHUT_RD);
+        if(conn_it != current_worker->connections.end() && conn_it->second.send_in_flight) {
+            uint64_t tag = uring_tag(URING_SEND, fd, conn_it->second.id);
+            current_worker->orphaned_sends.emplace(tag, current_worker->connections.extract(conn_it));
+        } else {
+            close(fd);
+            current_worker->connections.erase(fd);
+        }
+        return;
+    }
+#endif
+    epoll_ctl(current_worker->epoll_fd, EPOLL_CTL_DEL, fd, nullptr);
+    close(fd);
+    current_worker->connections.erase(fd);
+}
+
+// Apply everyone who logged in or out during this loop pass to the registry
+// with one publish rather than one each: after a restart or a network blip
+// the whole fleet reconnects at once, and every publish copies the registry.
+// Spooled messages are queued before a connection becomes routable; a router
+// that found no target waits on spool_mutex and re-resolves after we
+// publish. A closed connection's queue refuses messages from the moment it
+// is spooled (spool_undelivered), so those still routed to it are the
+// routers' to spool.
+void publish_registry_changes(Worker &worker) {
+    if(worker.registrations.empty() && worker.removals.empty()) return;
+    vector<Connection*> replayed_to;
+    {
+        lock_guard<mutex> lock(spool_mutex);
+        vector<shared_ptr<ClientInfo>> added;
+        for(const PendingRegistration &pending : worker.registrations) {
+            auto conn_it = worker.connections.find(pending.fd);
+            if(conn_it == worker.connections.end() || conn_it->second.id != pending.conn_id) continue;
+            Connection &conn = conn_it->second;
+            size_t replayed = replay_spool(conn);
+            if(replayed > 0) {
+                log_event(LOG_INFO, "Replayed %zu spooled message(s) to %s:%s", replayed,
+                          conn.campus.c_str(), conn.department.c_str());
+                replayed_to.push_back(&conn);
+            }
+            added.push_back(pending.info);
+        }
+        
+        vector<uint64_t> removed;
+        for(const auto &info : worker.removals) removed.push_back(info->conn_id);
+        sort(removed.begin(), removed.end());
+        // Each new one joins any connections already subscribed to the same department
+        update_registry([&](vector<shared_ptr<ClientInfo>> &clients) {
+            clients.erase(remove_if(clients.begin(), clients.end(), [&](const shared_ptr<ClientInfo> &entry) {
+                return binary_search(removed.begin(), removed.end(), entry->conn_id);
+            }), clients.end());
+            clients.insert(clients.end(), added.begin(), added.end());
+        });
+    }
+    worker.registrations.clear();
+    worker.removals.clear();
+    for(Connection *conn : replayed_to) flush_or_close(*conn);
+}
+
+
+// Timer callback: drop connections that never authenticated or whose
+// heartbeats stopped, otherwise re-arm lazily from the latest heartbeat
+void check_liveness(Worker &worker, const WheelTimer &timer) {
+    auto conn_it = worker.connections.find(timer.fd);
+    if(conn_it == worker.connections.end() || conn_it->second.id != timer.conn_id) return;
+    Connection &conn = conn_it->second;
+    if(timer.expires != conn.liveness_due) return;
+    
+    if(conn.state == ConnState::AWAIT_AUTH) {
+        log_event(LOG_WARN, "Closing unauthenticated connection after %ds", AUTH_TIMEOUT_SECONDS);
+        count_metric(METRIC_AUTH_TIMEOUTS);
+    } else {
+        int64_t timeout_ms = (int64_t)heartbeat_interval * heartbeat_misses * 1000;
+        int64_t deadline = conn.registration->last_seen_ms.load(memory_order_relaxed) + timeout_ms;
+        int64_t now = monotonic_ms();
+        if(now < deadline) {
+            conn.liveness_due = worker.liveness.schedule({timer.fd, timer.conn_id,
+                                                          (uint64_t)(deadline / 1000) + 1});
+            return;
+        }
+        // close_connection spools whatever was still queued for it
+        log_event(LOG_WARN, "Evicting %s:%s: no heartbeat for %llds", conn.campus.c_str(),
+                  conn.department.c_str(), (long long)((now - deadline + timeout_ms) / 1000));
+        count_metric(METRIC_EVICTIONS);
+    }
+    shutdown(timer.fd, SHUT_RDWR);
+    close_connection(timer.fd);
+}
+
+void handle_frame(Connection &conn, const FrameView &frame) {
+    if(frame.type == FRAME_ACK && (conn.frame_flags & FRAME_FLAG_ID)) {
+        route_ack(conn, frame);
+        return;
+    }
+    if(frame.type != FRAME_SEND || frame.campus.empty()) return;
+    if(frame.flags & ~conn.frame_flags) {
+        log_event(LOG_WARN, "Dropping frame from %s:%s: encoding was not negotiated",
+                  conn.campus.c_str(), conn.department.c_str());
+        return;
+    }
+    if((frame.flags & FRAME_FLAG_ID) && frame.payload.size() < MESSAGE_ID_SIZE) return;
+    route_campus_message(conn, frame.campus, frame.department, frame.payload, frame.flags);
+}
+
+// Tell a windowed sender that its frames so far have been routed. One credit
+// per read covers every frame in it and goes out with the connection's next
+// flush, together with whatever else is queued for it.
+void grant_credit(Connection &conn) {
+    bool needs_flush = enqueue_outbound(*conn.outbound, [&](string &out) {
+        encode_credit_frame(out, conn.uncredited);
+    });
+    conn.uncredited = 0;
+    if(needs_flush) schedule_flush(current_worker->id, conn.fd, conn.id);
+}
+
+// Run every complete line or frame in the reassembly buffer through the
+// connection's state machine. Returns false when the connection must be closed.
+bool process_input(Connection &conn) {
+    size_t consumed = 0;
+    // Each message's parse stage runs from the end of the previous one
+    int64_t mark = monotonic_ns();
+    
+    // A paused sender keeps the rest for resume_senders
+    while(consumed < conn.in_buf.size() && !conn.paused) {
+        const char *data = conn.in_buf.data() + consumed;
+        size_t available = conn.in_buf.size() - consumed;
+        
+        if(conn.state == ConnState::ACTIVE && conn.proto == PROTO_VERSION) {
+            FrameView frame;
+            size_t frame_size = 0;
+            FrameStatus status = decode_frame(data, available, frame, frame_size);
+            if(status == FrameStatus::INCOMPLETE) break;
+            if(status == FrameStatus::INVALID) {
+                log_event(LOG_WARN, "Dropping %s: malformed frame", conn.campus.c_str());
+                return false;
+            }
+            consumed += frame_size;
+            int64_t parsed = monotonic_ns();
+            record_stage(STAGE_PARSE, mark, parsed);
+            if(frame.type == FRAME_SEND) count_metric(METRIC_MESSAGES_RECEIVED);
+            handle_frame(conn, frame);
+            mark = monotonic_ns();
+            record_stage(STAGE_ROUTE, parsed, mark);
+            conn.uncredited++;
+            continue;
+        }
+        
+        const char *newline = (const char*)memchr(data, '\n', available);
+        if(newline == nullptr) break;
+        string_view line(data, newline - data);
+        consumed += line.size() + 1;
+        
+        // Remove the carriage return of CRLF line endings
+        if(!line.empty() && line.back() == '\r') line.remove_suffix(1);
+        
+        int64_t parsed = monotonic_ns();
+        if(conn.state == ConnState::AWAIT_AUTH) {
+            bool authenticated = handle_auth_line(conn, line);
+            mark = monotonic_ns();
+            record_stage(STAGE_AUTH, parsed, mark);
+            if(!authenticated) return false;
+        } else {
+            record_stage(STAGE_PARSE, mark, parsed);
+            if(line.substr(0, 5) == "SEND:") count_metric(METRIC_MESSAGES_RECEIVED);
+            handle_message_line(conn, line);
+            mark = monotonic_ns();
+            record_stage(STAGE_ROUTE, parsed, mark);
+        }
+    }
+    conn.in_buf.erase(0, consumed);
+    if(conn.credit_window > 0 && conn.uncredited > 0) grant_credit(conn);
+    
+    // Text lines are bounded by MAX_PENDING_INPUT, frames by their header
+    if(conn.proto != PROTO_VERSION && !conn.paused && conn.in_buf.size() > MAX_PENDING_INPUT) {
+        log_event(LOG_WARN, "Dropping connection with oversized unterminated message");
+        return false;
+    }
+    return true;
+}
+
+bool receive_bytes(Connection &conn, const char *data, size_t length) {
+    count_metric(METRIC_BYTES_RECEIVED, length);
+    conn.in_buf.append(data, length);
+    return process_input(conn);
+}
+
+// Drain the socket (edge-triggered), parsing after every read so the
+// reassembly buffer never holds more than one partial message plus a read.
+// A paused sender is left unread; resume_senders picks it up again.
+bool handle_campus_client(Connection &conn) {
+    char buffer[BUFFER_SIZE];
+    
+    while(!conn.paused) {
+        ssize_t bytes_received = recv(conn.fd, buffer, sizeof(buffer), 0);
+        if(bytes_received > 0) {
+            if(!receive_bytes(conn, buffer, bytes_received)) return false;
+            continue;
+        }
+        if(bytes_received < 0 && errno == EINTR) continue;
+        if(bytes_received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) break;
+        return false;
+    }
+    return true;
+}
+
+// Start tracking a freshly accepted socket; both backends come through here
+Connection &add_connection(Worker &worker, int client_socket) {
+    // Writes are already batched per flush; Nagle would only delay the tail
+    int nodelay = 1;
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+    
+    count_metric(METRIC_CONNECTIONS_ACCEPTED);
+    Connection &conn = worker.connections[client_socket];
+    conn.fd = client_socket;
+    conn.id = next_conn_id++;
+    conn.liveness_due = worker.liveness.schedule({client_socket, conn.id,
+                                                  current_tick() + AUTH_TIMEOUT_SECONDS});
+    return conn;
+}
+
+void accept_campus_clients(Worker &worker) {
+    while(true) {
+        sockaddr_in client_addr;
+        socklen_t addr_len = sizeof(client_addr);
+        int client_socket = accept4(worker.listen_fd, (sockaddr*)&client_addr, &addr_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        
+        if(client_socket < 0) {
+            if(errno == EINTR) continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) perror("accept error");
+            return;
+        }
+        
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+        ev.data.fd = client_socket;
+        if(epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, client_socket, &ev) < 0) {
+            perror("epoll_ctl client");
+            close(client_socket);
+            continue;
+        }
+        add_connection(worker, client_socket);
+    }
+}
+
+// One heartbeat pulled out of a recvmmsg batch
+struct HeartbeatUpdate {
+    int campus_id;
+    uint64_t conn_id;           // 0 for text heartbeats
+    string_view department;     // Text heartbeats only; empty = every department
+    uint64_t endpoint;
+};
+
+// Turn one datagram into a heartbeat update; false if it is not a heartbeat
+bool parse_heartbeat(const char *data, size_t length, const sockaddr_in &source,
+                     HeartbeatUpdate &update) {
+    HeartbeatPacket packet;
+    if(decode_heartbeat(data, length, packet)) {
+        if(packet.campus_id >= campus_names.size()) return false;
+        update = {packet.campus_id, packet.conn_id, {}, pack_endpoint(source)};
+        return true;
+    }
+    
+    // HEARTBEAT:<campus>[:<dept>]
+    string_view message(data, length);
+    if(message.substr(0, 10) != "HEARTBEAT:") return false;
+    message.remove_prefix(10);
+    size_t colon = message.find(':');
+    string_view department = colon == string_view::npos ? string_view() : message.substr(colon + 1);
+    int id = campus_id(message.substr(0, colon));
+    if(id < 0) return false;
+    update = {id, 0, department, pack_endpoint(source)};
+    return true;
+}
+
+// Apply a whole batch inside one registry read section. Heartbeat state is
+// atomic, so no writer round-trip is needed.
+void apply_heartbeats(const HeartbeatUpdate *updates, size_t count) {
+    if(count == 0) return;
+    
+    int64_t now = monotonic_ms();
+    size_t applied = 0;
+    RegistryReader registry_view;
+    for(size_t i = 0; i < count; i++) {
+        const HeartbeatUpdate &update = updates[i];
+        for(const SubscriptionGroup *group : registry_view->by_campus[update.campus_id]) {
+            for(const ClientInfo *client : group->members) {
+                if(update.conn_id != 0 && update.conn_id != client->conn_id) continue;
+                if(!update.department.empty() && update.department != client->department) continue;
+                client->udp_endpoint.store(update.endpoint, memory_order_relaxed);
+                client->last_seen_ms.store(now, memory_order_relaxed);
+                applied++;
+            }
+        }
+    }
+    log_event(LOG_DEBUG, "Heartbeat batch: %zu datagrams, %zu applied", count, applied);
+}
+
+// Drain the UDP socket UDP_BATCH datagrams per syscall (edge-triggered)
+void handle_udp_datagrams(int udp_socket) {
+    static char buffers[UDP_BATCH][UDP_DATAGRAM_SIZE];
+    static sockaddr_in sources[UDP_BATCH];
+    static iovec vectors[UDP_BATCH];
+    static mmsghdr messages[UDP_BATCH];
+    static HeartbeatUpdate updates[UDP_BATCH];
+    
+    while(true) {
+        for(int i = 0; i < UDP_BATCH; i++) {
+            vectors[i] = {buffers[i], UDP_DATAGRAM_SIZE};
+            memset(&messages[i], 0, sizeof(messages[i]));
+            messages[i].msg_hdr.msg_name = &sources[i];
+            messages[i].msg_hdr.msg_namelen = sizeof(sources[i]);
+            messages[i].msg_hdr.msg_iov = &vectors[i];
+            messages[i].msg_hdr.msg_iovlen = 1;
+        }
+        
+        int received = recvmmsg(udp_socket, messages, UDP_BATCH, MSG_DONTWAIT, nullptr);
+        if(received < 0 && errno == EINTR) continue;
+        if(received <= 0) return;
+        
+        int64_t started = monotonic_ns();
+        size_t update_count = 0;
+        for(int i = 0; i < received; i++) {
+            if(messages[i].msg_hdr.msg_flags & MSG_TRUNC) continue;
+            if(parse_heartbeat(buffers[i], messages[i].msg_len, sources[i], updates[update_count])) {
+                update_count++;
+            }
+        }
+        apply_heartbeats(updates, update_count);
+        record_stage(STAGE_HEARTBEAT, started);
+        count_metric(METRIC_HEARTBEATS, update_count);
+        count_metric(METRIC_HEARTBEATS_INVALID, received - update_count);
+        
+        if(received < UDP_BATCH) return;
+    }
+}
+
+void pin_to_cpu(int cpu) {
+    unsigned cpu_count = thread::hardware_concurrency();
+    if(cpu_count == 0) return;
+    
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(cpu % cpu_count, &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+}
+
+// Edge-triggered event loop for one worker: its listener, the campus sockets
+// accepted on it, its wakeup eventfd and (worker 0 only) the UDP socket.
+// Work every event loop pass ends with, whichever backend delivered events
+#ifdef NU_HAVE_IO_URING
+void uring_arm_recv(Worker &worker, Connection &conn);
+#endif
+
+// Read again from senders whose slow consumer drained or went away: first
+// what they had already sent, then the socket
+void resume_senders(Worker &worker) {
+    vector<FlushRequest> resumed;
+    {
+        lock_guard<mutex> lock(worker.flush_mutex);
+        if(worker.resume_list.empty()) return;
+        resumed.swap(worker.resume_list);
+    }
+    
+    for(const auto &request : resumed) {
+        auto conn_it = worker.connections.find(request.fd);
+        if(conn_it == worker.connections.end() || conn_it->second.id != request.conn_id) continue;
+        Connection &conn = conn_it->second;
+        if(!conn.paused) continue;
+        conn.paused = false;
+        paused_senders--;
+        record_stage(STAGE_BLOCKED, conn.paused_ns);
+        
+        bool keep = process_input(conn);
+#ifdef NU_HAVE_IO_URING
+        if(io_backend == IoBackend::IO_URING) {
+            // A recv still being cancelled re-arms itself when it ends
+            if(keep && !conn.paused && !conn.recv_armed) uring_arm_recv(worker, conn);
+        } else
+#endif
+        if(keep) keep = handle_campus_client(conn);
+        if(!keep) {
+            flush_connection(conn);
+            close_connection(request.fd);
+        }
+    }
+}
+
+void finish_loop_pass(Worker &worker) {
+    publish_registry_changes(worker);
+    resume_senders(worker);
+    drain_flush_list(worker);
+    flush_deferred(worker);
+    worker.liveness.advance(current_tick(), [&](const WheelTimer &timer) {
+        check_liveness(worker, timer);
+    });
+}
+
+void close_all_connections(Worker &worker) {
+    vector<int> open_fds;
+    for(const auto &conn : worker.connections) open_fds.push_back(conn.first);
+    for(int fd : open_fds) {
+        shutdown(fd, SHUT_RDWR);
+        close_connection(fd);
+    }
+    // Other workers stop routing to them
+    publish_registry_changes(worker);
+}
+
+// A worker starts with only the connections adopted from a previous server
+// (see adopt_connections), or those it kept through a failed handoff. Arm
+// their deadlines and receives, then parse what had been read and write
+// what had been queued.
+void start_adopted_connections(Worker &worker) {
+    vector<int> adopted;
+    for(const auto &conn : worker.connections) adopted.push_back(conn.first);
+    for(int fd : adopted) {
+        auto conn_it = worker.connections.find(fd);
+        if(conn_it == worker.connections.end()) continue;
+        Connection &conn = conn_it->second;
+        uint64_t timeout = conn.state == ConnState::ACTIVE ? (uint64_t)heartbeat_interval * heartbeat_misses + 1
+                                                           : AUTH_TIMEOUT_SECONDS;
+        conn.liveness_due = worker.liveness.schedule({fd, conn.id, current_tick() + timeout});
+#ifdef NU_HAVE_IO_URING
+        if(io_backend == IoBackend::IO_URING) uring_arm_recv(worker, conn);
+#endif
+        if(!process_input(conn)) {
+            flush_connection(conn);
+            close_connection(fd);
+            continue;
+        }
+        flush_or_close(conn);
+    }
+}
+
+void reactor_loop(Worker *worker, int udp_socket, bool pin) {
+    current_worker = worker;
+    if(pin) pin_to_cpu(worker->id);
+    worker->liveness.start(current_tick());
+    start_adopted_connections(*worker);
+    
+    auto &connections = worker->connections;
+    epoll_event events[MAX_EVENTS];
+    
+    while(server_running) {
+        int ready = epoll_wait(worker->epoll_fd, events, MAX_EVENTS, next_wait_ms(*worker));
+        
+        if(ready < 0 && errno != EINTR) {
+            perror("epoll_wait");
+            break;
+        }
+        
+        for(int i = 0; i < ready && server_running; i++) {
+            int fd = events[i].data.fd;
+            uint32_t flags = events[i].events;
+            
+            if(fd == worker->listen_fd) {
+                accept_campus_clients(*worker);
+            } else if(fd == udp_socket) {
+                handle_udp_datagrams(udp_socket);
+            } else if(fd == worker->wakeup_fd) {
+                uint64_t count;
+                ssize_t ignored = read(worker->wakeup_fd, &count, sizeof(count));
+                (void)ignored;
+            } else {
+                auto conn_it = connections.find(fd);
+                if(conn_it == connections.end()) continue;
+                
+                bool keep = !(flags & EPOLLERR);
+                if(keep && (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP))) {
+                    keep = handle_campus_client(conn_it->second);
+                }
+                if(keep && (flags & EPOLLOUT)) {
+                    keep = flush_connection(conn_it->second);
+                }
+                if(!keep) {
+                    // Give AUTH_FAIL a chance to reach the peer before closing
+                    flush_connection(conn_it->second);
+                    close_connection(fd);
+                }
+            }
+        }
+        
+        finish_loop_pass(*worker);
+    }
+    // A successor that took our connections reads and writes them from here
+    if(!hand_over_connections) close_all_connections(*worker);
+}
+
+#ifdef NU_HAVE_IO_URING
+// ---- io_uring backend ----
+// The same worker model as reactor_loop, but sockets are never polled: the
+// listener has a multishot accept, each connection a multishot recv into
+// the worker's provided buffers, the UDP socket (worker 0) a multishot
+// recvmsg, and sends are submitted to the ring. One io_uring_enter per pass
+// both submits and reaps.
+
+void uring_arm_accept(Worker &worker) {
+    if(io_uring_sqe *sqe = uring_sqe(worker, uring_tag(URING_ACCEPT))) {
+        prep_multishot_accept(sqe, worker.listen_fd, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        worker.accept_armed = true;
+    }
+}
+
+void uring_arm_recv(Worker &worker, Connection &conn) {
+    if(io_uring_sqe *sqe = uring_sqe(worker, uring_tag(URING_RECV, conn.fd, conn.id))) {
+        prep_multishot_recv(sqe, conn.fd, 0);
+        conn.recv_armed = true;
+    }
+}
+
+// Stop a paused sender's multishot recv, so the kernel's socket buffer and
+// then TCP flow control hold back its bytes rather than in_buf
+void uring_cancel_recv(Worker &worker, Connection &conn) {
+    if(io_uring_sqe *sqe = uring_sqe(worker, uring_tag(URING_CANCEL, conn.fd, conn.id))) {
+        prep_cancel(sqe, uring_tag(URING_RECV, conn.fd, conn.id));
+        conn.recv_cancelling = true;
+    }
+}
+
+void uring_arm_udp(Worker &worker, int udp_socket) {
+    if(io_uring_sqe *sqe = uring_sqe(worker, uring_tag(URING_UDP))) {
+        prep_multishot_recvmsg(sqe, udp_socket, &worker.udp_msg, 1);
+        worker.udp_armed = true;
+    }
+}
+
+void uring_arm_wakeup(Worker &worker) {
+    if(io_uring_sqe *sqe = uring_sqe(worker, uring_tag(URING_WAKEUP))) {
+        prep_read(sqe, worker.wakeup_fd, &worker.wakeup_count, sizeof(worker.wakeup_count));
+    }
+}
+
+// Create the worker's ring and buffer groups. False if this kernel cannot
+// run the backend; the caller then falls back to epoll.
+bool setup_uring(Worker &worker, int udp_socket) {
+    worker.uring.reset(new IoUring());
+    if(!worker.uring->init(URING_ENTRIES)) return false;
+    // Multishot recv and recvmsg arrived in Linux 6.0 together with SEND_ZC,
+    // which the probe can see and the multishot flags cannot
+    if(!worker.uring->supports(IORING_OP_SEND_ZC)) {
+        errno = ENOSYS;
+        return false;
+    }
+    
+    worker.recv_buffers.reset(new BufferRing());
+    if(!worker.recv_buffers->init(*worker.uring, 0, URING_RECV_BUFFERS, BUFFER_SIZE)) return false;
+    if(worker.id == 0) {
+        worker.udp_buffers.reset(new BufferRing());
+        unsigned size = sizeof(io_uring_recvmsg_out) + sizeof(sockaddr_in) + UDP_DATAGRAM_SIZE;
+        if(!worker.udp_buffers->init(*worker.uring, 1, URING_UDP_BUFFERS, size)) return false;
+        worker.udp_msg.msg_namelen = sizeof(sockaddr_in);
+        uring_arm_udp(worker, udp_socket);
+    }
+    uring_arm_accept(worker);
+    uring_arm_wakeup(worker);
+    return true;
+}
+
+void release_uring(Worker &worker) {
+    worker.uring.reset();
+    worker.recv_buffers.reset();
+    worker.udp_buffers.reset();
+    for(auto &orphan : worker.orphaned_sends) close(orphan.second.mapped().fd);
+    worker.orphaned_sends.clear();
+}
+
+void uring_recv_done(Worker &worker, const io_uring_cqe &cqe) {
+    int fd = (int)(cqe.user_data >> 32 & 0xFFFFFF);
+    bool has_buffer = cqe.flags & IORING_CQE_F_BUFFER;
+    uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+    
+    auto conn_it = worker.connections.find(fd);
+    bool ours = conn_it != worker.connections.end() && (uint32_t)conn_it->second.id == (uint32_t)cqe.user_data;
+    bool keep = ours;
+    if(ours && cqe.res > 0 && has_buffer) {
+        keep = receive_bytes(conn_it->second, worker.recv_buffers->buffer(buffer_id), cqe.res);
+    } else if(ours && cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+        keep = false;   // Peer closed (0) or the socket failed
+    }
+    if(has_buffer) worker.recv_buffers->recycle(buffer_id);
+    if(!ours) return;
+    
+    Connection &conn = conn_it->second;
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if(!more) {
+        conn.recv_armed = false;
+        conn.recv_cancelling = false;
+    }
+    if(!keep) {
+        // Give AUTH_FAIL a chance to reach the peer before closing
+        flush_connection(conn);
+        close_connection(fd);
+    } else if(conn.paused) {
+        if(more && !conn.recv_cancelling) uring_cancel_recv(worker, conn);
+    } else if(!more && server_running) {
+        uring_arm_recv(worker, conn);   // Out of buffers (recycled above), or cancelled and resumed
+    }
+}
+
+void uring_send_done(Worker &worker, const io_uring_cqe &cqe) {
+    auto orphan = worker.orphaned_sends.find(cqe.user_data);
+    if(orphan != worker.orphaned_sends.end()) {
+        close(orphan->second.mapped().fd);
+        worker.orphaned_sends.erase(orphan);
+        return;
+    }
+    int fd = (int)(cqe.user_data >> 32 & 0xFFFFFF);
+    auto conn_it = worker.connections.find(fd);
+    if(conn_it == worker.connections.end() || (uint32_t)conn_it->second.id != (uint32_t)cqe.user_data) return;
+    
+    Connection &conn = conn_it->second;
+    conn.send_in_flight = false;
+    record_stage(STAGE_SEND, conn.send_started_ns);
+    if(cqe.res > 0) {
+        count_write(conn, cqe.res);
+        conn.send_offset += cqe.res;
+    }
+    bool retry = cqe.res > 0 || cqe.res == -EAGAIN || cqe.res == -EINTR;
+    if(!retry || !uring_flush(conn)) {
+        log_event(LOG_WARN, "Failed to send message to %s", conn.campus.c_str());
+        close_connection(fd);
+    }
+}
+
+// One UDP datagram from the multishot recvmsg. parse_heartbeat's department
+// view points into the provided buffer, so each heartbeat is applied before
+// the buffer goes back to the kernel.
+void uring_udp_done(Worker &worker, const io_uring_cqe &cqe, int udp_socket) {
+    if(cqe.flags & IORING_CQE_F_BUFFER) {
+        uint16_t buffer_id = cqe.flags >> IORING_CQE_BUFFER_SHIFT;
+        char *buffer = worker.udp_buffers->buffer(buffer_id);
+        if(cqe.res > 0) {
+            const io_uring_recvmsg_out *out = (const io_uring_recvmsg_out*)buffer;
+            const char *name = buffer + sizeof(io_uring_recvmsg_out);
+            const char *payload = name + worker.udp_msg.msg_namelen + worker.udp_msg.msg_controllen;
+            sockaddr_in source{};
+            memcpy(&source, name, min<size_t>(out->namelen, sizeof(source)));
+            int64_t started = monotonic_ns();
+            HeartbeatUpdate update;
+            if(!(out->flags & MSG_TRUNC) && parse_heartbeat(payload, out->payloadlen, source, update)) {
+                apply_heartbeats(&update, 1);
+                record_stage(STAGE_HEARTBEAT, started);
+                count_metric(METRIC_HEARTBEATS);
+            } else {
+                count_metric(METRIC_HEARTBEATS_INVALID);
+            }
+        }
+        worker.udp_buffers->recycle(buffer_id);
     }
-    
-    // Validate
-    if(campus_name.empty() || password.empty()) {
-        send_tcp_message(client_socket, "AUTH_FAIL:Missing credentials");
-        close(client_socket);
-        return;
+    if(cqe.flags & IORING_CQE_F_MORE) return;
+    worker.udp_armed = false;
+    if(server_running) uring_arm_udp(worker, udp_socket);
+}
+
+void uring_dispatch(Worker &worker, const io_uring_cqe &cqe, int udp_socket) {
+    switch((UringOp)(cqe.user_data >> 56)) {
+    case URING_ACCEPT:
+        if(cqe.res >= 0) {
+            // One accepted as the server stops is read by whoever ends up with it
+            Connection &conn = add_connection(worker, cqe.res);
+            if(server_running) uring_arm_recv(worker, conn);
+        } else if(cqe.res != -EINTR && cqe.res != -ECONNABORTED && cqe.res != -ECANCELED) {
+            log_event(LOG_WARN, "accept error: %s", strerror(-cqe.res));
+        }
+        if(cqe.flags & IORING_CQE_F_MORE) break;
+        worker.accept_armed = false;
+        if(server_running) uring_arm_accept(worker);
+        break;
+    case URING_RECV:
+        uring_recv_done(worker, cqe);
+        break;
+    case URING_SEND:
+        uring_send_done(worker, cqe);
+        break;
+    case URING_UDP:
+        uring_udp_done(worker, cqe, udp_socket);
+        break;
+    case URING_WAKEUP:
+        uring_arm_wakeup(worker);
+        break;
+    case URING_CANCEL:
+        break;      // The cancelled operation reports for itself
     }
-    
-    auto valid_cred = campus_credentials.find(campus_name);
-    if(valid_cred == campus_credentials.end() || valid_cred->second != password) {
-        send_tcp_message(client_socket, "AUTH_FAIL:Invalid credentials");
-        close(client_socket);
-        return;
+}
+
+// On the way out: cancel the accept, the UDP recvmsg and every recv, and
+// let sends in flight complete, so the ring neither reads nor writes a
+// socket once it may change hands. Bytes that arrive meanwhile are parsed
+// as usual. A connection still busy after HANDOFF_QUIESCE_MS is closed.
+void uring_quiesce(Worker &worker, int udp_socket) {
+    auto cancel = [&](uint64_t target) {
+        if(io_uring_sqe *sqe = uring_sqe(worker, uring_tag(URING_CANCEL))) prep_cancel(sqe, target);
+    };
+    if(worker.accept_armed) cancel(uring_tag(URING_ACCEPT));
+    if(worker.udp_armed) cancel(uring_tag(URING_UDP));
+    for(auto &entry : worker.connections) {
+        Connection &conn = entry.second;
+        if(conn.recv_armed && !conn.recv_cancelling) uring_cancel_recv(worker, conn);
     }
     
-    // Register client
-    {
-        lock_guard<mutex> lock(clients_mutex);
-        ClientInfo client_info;
-        client_info.tcp_sock = client_socket;
-        client_info.campus = campus_name;
-        client_info.department = department.empty() ? "General" : department;
-        client_info.last_seen = get_current_time();
-        connected_clients[campus_name] = client_info;
-        socket_to_campus[client_socket] = campus_name;
+    auto busy = [&]() {
+        if(worker.accept_armed || worker.udp_armed) return true;
+        for(const auto &entry : worker.connections) {
+            if(entry.second.recv_armed || entry.second.send_in_flight) return true;
+        }
+        return false;
+    };
+    int64_t deadline = monotonic_ms() + HANDOFF_QUIESCE_MS;
+    while(busy()) {
+        int64_t remaining = deadline - monotonic_ms();
+        if(remaining <= 0 || worker.uring->submit_and_wait(1, (int)remaining) < 0) break;
+        worker.uring->drain_completions([&](const io_uring_cqe &cqe) {
+            uring_dispatch(worker, cqe, udp_socket);
+        });
+        publish_registry_changes(worker);
     }
     
-    server_log("Campus authenticated: " + campus_name + " (Dept: " + 
-               (department.empty() ? "General" : department) + ")");
-    send_tcp_message(client_socket, "AUTH_OK:" + campus_name);
+    vector<int> stuck;
+    for(const auto &entry : worker.connections) {
+        if(entry.second.recv_armed || entry.second.send_in_flight) stuck.push_back(entry.first);
+    }
+    if(!stuck.empty()) log_event(LOG_WARN, "Closing %zu connection(s) io_uring did not let go of", stuck.size());
+    for(int fd : stuck) {
+        shutdown(fd, SHUT_RDWR);
+        close_connection(fd);
+    }
+    publish_registry_changes(worker);
+}
+
+void uring_reactor_loop(Worker *worker, int udp_socket, bool pin) {
+    current_worker = worker;
+    if(pin) pin_to_cpu(worker->id);
+    worker->liveness.start(current_tick());
+    start_adopted_connections(*worker);
     
-    // Handle client messages
     while(server_running) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(client_socket, &read_fds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(client_socket + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if(activity < 0 && errno != EINTR) {
+        if(worker->uring->submit_and_wait(1, next_wait_ms(*worker)) < 0) {
+            perror("io_uring_enter");
             break;
         }
         
-        if(!server_running) {
-            break;
-        }
+        worker->uring->drain_completions([&](const io_uring_cqe &cqe) {
+            uring_dispatch(*worker, cqe, udp_socket);
+        });
         
-        if(activity > 0 && FD_ISSET(client_socket, &read_fds)) {
-            bytes_received = recv(client_socket, buffer, BUFFER_SIZE - 1, 0);
-            if(bytes_received <= 0) break;
-            
-            buffer[bytes_received] = '\0';
-            string message(buffer);
-            
-            // Remove carriage returns and newlines
-            message.erase(remove(message.begin(), message.end(), '\r'), message.end());
-            message.erase(remove(message.begin(), message.end(), '\n'), message.end());
-            
-            // Check if it's a SEND message
-            if(message.find("SEND:") == 0) {
-                string payload = message.substr(5);
-                size_t first_colon = payload.find(':');
-                size_t second_colon = payload.find(':', first_colon + 1);
-                
-                if(first_colon != string::npos && second_colon != string::npos) {
-                    string target_campus = payload.substr(0, first_colon);
-                    string target_dept = payload.substr(first_colon + 1, second_colon - first_colon - 1);
-                    string message_text = payload.substr(second_colon + 1);
-                    
-                    string source_campus, source_dept;
-                    {
-                        lock_guard<mutex> lock(clients_mutex);
-                        auto source_it = socket_to_campus.find(client_socket);
-                        if(source_it != socket_to_campus.end()) {
-                            source_campus = source_it->second;
-                            auto client_it = connected_clients.find(source_campus);
-                            if(client_it != connected_clients.end()) {
-                                source_dept = client_it->second.department;
-                            }
-                        }
-                    }
-                    
-                    if(!target_campus.empty()) {
-                        route_campus_message(source_campus, source_dept, target_campus, message_text);
-                    }
-                }
-            }
-        }
+        finish_loop_pass(*worker);
     }
-    
-    // Cleanup on disconnect
-    {
-        lock_guard<mutex> lock(clients_mutex);
-        auto sock_it = socket_to_campus.find(client_socket);
-        if(sock_it != socket_to_campus.end()) {
-            string campus = sock_it->second;
-            connected_clients.erase(campus);
-            socket_to_campus.erase(sock_it);
-            server_log("Campus disconnected: " + campus);
+    // The listeners may be going to a successor too: nothing may be left
+    // accepting on them from our ring
+    uring_quiesce(*worker, udp_socket);
+    if(!hand_over_connections) close_all_connections(*worker);
+    release_uring(*worker);
+}
+#endif
+
+// ---- Broadcast engine ----
+struct BroadcastTarget {
+    string campus;
+    sockaddr_in addr;
+};
+
+struct BroadcastFailure {
+    string campus;
+    int error;
+};
+
+struct BroadcastResult {
+    int sent = 0;
+    int syscalls = 0;
+    vector<BroadcastFailure> failures;
+};
+
+// Copy the UDP destinations out of the registry so sending happens outside
+// any read-side section
+vector<BroadcastTarget> snapshot_broadcast_targets() {
+    vector<BroadcastTarget> targets;
+    RegistryReader registry_view;
+    for(const SubscriptionGroup *group : registry_view->everyone) {
+        for(const ClientInfo *client : group->members) {
+            uint64_t endpoint = client->udp_endpoint.load();
+            if(endpoint != 0) targets.push_back({client->campus, unpack_endpoint(endpoint)});
         }
     }
-    close(client_socket);
+    return targets;
 }
 
-void tcp_server_loop(int server_socket) {
-    while(server_running) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(server_socket, &read_fds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(server_socket + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if(activity < 0 && errno != EINTR) {
-            break;
+// Send one datagram to every target, BROADCAST_BATCH per sendmmsg call. A
+// destination the kernel rejects is recorded and skipped; a full socket
+// buffer is waited out for up to BROADCAST_SEND_TIMEOUT_MS.
+BroadcastResult send_broadcast(int udp_socket, const vector<BroadcastTarget> &targets,
+                               string_view message) {
+    BroadcastResult result;
+    iovec payload{(void*)message.data(), message.size()};
+    mmsghdr batch[BROADCAST_BATCH];
+    
+    size_t next = 0;
+    while(next < targets.size()) {
+        size_t count = min(targets.size() - next, (size_t)BROADCAST_BATCH);
+        for(size_t i = 0; i < count; i++) {
+            memset(&batch[i], 0, sizeof(batch[i]));
+            batch[i].msg_hdr.msg_name = (void*)&targets[next + i].addr;
+            batch[i].msg_hdr.msg_namelen = sizeof(sockaddr_in);
+            batch[i].msg_hdr.msg_iov = &payload;
+            batch[i].msg_hdr.msg_iovlen = 1;
         }
         
-        if(!server_running) {
-            break;
+        int sent = sendmmsg(udp_socket, batch, count, 0);
+        result.syscalls++;
+        if(sent > 0) {
+            result.sent += sent;
+            next += sent;
+            continue;
         }
         
-        if(activity > 0 && FD_ISSET(server_socket, &read_fds)) {
-            sockaddr_in client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            int client_socket = accept(server_socket, (sockaddr*)&client_addr, &addr_len);
-            
-            if(client_socket < 0) {
-                if(errno == EINTR) continue;
-                perror("accept error");
-                break;
-            }
-            
-            thread client_thread(handle_campus_client, client_socket);
-            client_thread.detach();
+        if(sent < 0 && errno == EINTR) continue;
+        if(sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pollfd writable{udp_socket, POLLOUT, 0};
+            if(poll(&writable, 1, BROADCAST_SEND_TIMEOUT_MS) > 0) continue;
         }
+        // The first datagram of the batch failed: report it and move past it
+        result.failures.push_back({targets[next].campus, sent < 0 ? errno : EIO});
+        next++;
     }
+    return result;
 }
 
-void udp_server_loop(int udp_socket) {
-    char buffer[BUFFER_SIZE];
-    
-    while(server_running) {
-        fd_set read_fds;
-        FD_ZERO(&read_fds);
-        FD_SET(udp_socket, &read_fds);
-        
-        struct timeval timeout;
-        timeout.tv_sec = 1;
-        timeout.tv_usec = 0;
-        
-        int activity = select(udp_socket + 1, &read_fds, NULL, NULL, &timeout);
-        
-        if(activity < 0 && errno != EINTR) {
-            break;
-        }
-        
-        if(!server_running) {
-            break;
+// Values read from live state rather than counted
+struct GaugeReadings {
+    size_t connections = 0;
+    uint64_t queued_bytes = 0;      // Waiting in outbound queues
+    int64_t paused_senders = 0;     // Not being read (block policy)
+    size_t spooled = 0;             // Undelivered spool records
+    uint64_t log_dropped = 0;
+};
+
+GaugeReadings read_gauges() {
+    GaugeReadings gauges;
+    gauges.paused_senders = paused_senders.load(memory_order_relaxed);
+    {
+        RegistryReader registry_view;
+        gauges.connections = registry_view->clients.size();
+        for(const auto &client : registry_view->clients) {
+            gauges.queued_bytes += client->outbound->pending_bytes.load(memory_order_relaxed);
         }
-        
-        if(activity > 0 && FD_ISSET(udp_socket, &read_fds)) {
-            sockaddr_in client_addr;
-            socklen_t addr_len = sizeof(client_addr);
-            
-            ssize_t bytes_received = recvfrom(udp_socket, buffer, BUFFER_SIZE - 1, 0,
-                                             (sockaddr*)&client_addr, &addr_len);
-            
-            if(bytes_received <= 0) continue;
-            
-            buffer[bytes_received] = '\0';
-            string message(buffer);
-            
-            // Handle heartbeat messages
-            if(message.find("HEARTBEAT:") == 0) {
-                string campus_name = message.substr(10);
-                
-                lock_guard<mutex> lock(clients_mutex);
-                auto client_it = connected_clients.find(campus_name);
-                if(client_it != connected_clients.end()) {
-                    client_it->second.udp_addr = client_addr;
-                    client_it->second.has_udp = true;
-                    client_it->second.last_seen = get_current_time();
-                    server_log("Heartbeat from " + campus_name);
-                }
-            }
+    }
+    {
+        lock_guard<mutex> lock(spool_mutex);
+        for(const auto &segments : spools) {
+            for(const SpoolSegment &segment : segments) gauges.spooled += segment.pending;
         }
     }
+    // Under the ring lock a drain cannot move a count between the two
+    lock_guard<mutex> lock(log_rings_mutex);
+    gauges.log_dropped = log_records_dropped.load(memory_order_relaxed);
+    for(const auto &ring : log_rings) gauges.log_dropped += ring->dropped.load(memory_order_relaxed);
+    return gauges;
+}
+
+// Everything in Prometheus text format, for the --metrics-listen endpoint
+string format_prometheus() {
+    string out;
+    for(int id = 0; id < METRIC_COUNT; id++) {
+        append_metric_header(out, metric_info[id].name, "counter", metric_info[id].help);
+        append_metric_sample(out, metric_info[id].name, "", (double)metric_total((MetricId)id));
+    }
+    
+    GaugeReadings gauges = read_gauges();
+    append_metric_header(out, "nu_connections", "gauge", "Authenticated campus connections");
+    append_metric_sample(out, "nu_connections", "", (double)gauges.connections);
+    append_metric_header(out, "nu_outbound_queued_bytes", "gauge", "Bytes waiting in outbound queues");
+    append_metric_sample(out, "nu_outbound_queued_bytes", "", (double)gauges.queued_bytes);
+    append_metric_header(out, "nu_senders_paused", "gauge", "Senders not being read until a full queue drains");
+    append_metric_sample(out, "nu_senders_paused", "", (double)gauges.paused_senders);
+    append_metric_header(out, "nu_spool_pending_messages", "gauge", "Spooled messages not yet delivered");
+    append_metric_sample(out, "nu_spool_pending_messages", "", (double)gauges.spooled);
+    append_metric_header(out, "nu_log_records_dropped_total", "counter", "Log records lost to full rings");
+    append_metric_sample(out, "nu_log_records_dropped_total", "", (double)gauges.log_dropped);
+    
+    append_metric_header(out, "nu_socket_writes_total", "counter", "TCP writes, per worker");
+    for(const auto &worker : workers) {
+        append_metric_sample(out, "nu_socket_writes_total", "worker=\"" + to_string(worker->id) + "\"",
+                             (double)worker->write_calls.load(memory_order_relaxed));
+    }
+    append_metric_header(out, "nu_socket_bytes_written_total", "counter", "TCP bytes written, per worker");
+    for(const auto &worker : workers) {
+        append_metric_sample(out, "nu_socket_bytes_written_total", "worker=\"" + to_string(worker->id) + "\"",
+                             (double)worker->bytes_written.load(memory_order_relaxed));
+    }
+    
+    append_metric_header(out, "nu_stage_duration_seconds", "histogram", "Time spent per processing stage");
+    for(int stage = 0; stage < STAGE_COUNT; stage++) {
+        append_histogram_samples(out, "nu_stage_duration_seconds",
+                                 string("stage=\"") + stage_names[stage] + "\"", stage_snapshot((Stage)stage));
+    }
+    return out;
+}
+
+// The counters, gauges and stage latencies part of the "stats" command
+void print_metrics() {
+    char line[160];
+    cout << "\n--- Counters ---\n";
+    for(int id = 0; id < METRIC_COUNT; id++) {
+        // nu_<name>_total
+        string name(metric_info[id].name + 3);
+        name.resize(name.size() - 6);
+        snprintf(line, sizeof(line), "%-28s %llu\n", name.c_str(), (unsigned long long)metric_total((MetricId)id));
+        cout << line;
+    }
+    
+    GaugeReadings gauges = read_gauges();
+    cout << "Connections: " << gauges.connections << " | Queued: " << gauges.queued_bytes << " bytes"
+         << " | Paused senders: " << gauges.paused_senders
+         << " | Spooled: " << gauges.spooled << " | Log records dropped: " << gauges.log_dropped << "\n";
+    
+    cout << "\n--- Stage Latency (microseconds) ---\n";
+    snprintf(line, sizeof(line), "%-10s %12s %10s %10s %10s %10s\n", "stage", "count", "p50", "p99", "p99.9", "max");
+    cout << line;
+    for(int stage = 0; stage < STAGE_COUNT; stage++) {
+        HistogramSnapshot snapshot = stage_snapshot((Stage)stage);
+        snprintf(line, sizeof(line), "%-10s %12llu %10.1f %10.1f %10.1f %10.1f\n", stage_names[stage],
+                 (unsigned long long)snapshot.count, snapshot.percentile(0.5) / 1e3,
+                 snapshot.percentile(0.99) / 1e3, snapshot.percentile(0.999) / 1e3, snapshot.max_value / 1e3);
+        cout << line;
+    }
 }
 
 void admin_console(int udp_socket) {
@@ -320,26 +2943,44 @@ void admin_console(int udp_socket) {
     cout << "\n======================================================\n";
     cout << "NU Information Exchange System - Admin Console\n";
     cout << "======================================================\n";
-    cout << "Commands: list | broadcast:<message> | quit | help\n";
+    cout << "Commands: list | stats | broadcast:<message> | quit | help\n";
     cout << "======================================================\n\n";
 	cout << "admin>";
     
-    while(server_running && getline(cin, command)) {
+    // Not stopped by server_running: a handoff that fails resumes serving
+    while(getline(cin, command)) {
         if(command == "list") {
-            lock_guard<mutex> lock(clients_mutex);
+            RegistryReader registry_view;
+            int connected = 0;
             cout << "\n--- Connected Campuses ---\n";
-            if(connected_clients.empty()) {
-                cout << "No campuses connected.\n";
-            } else {
-                for(const auto& client : connected_clients) {
-                    cout << "Campus: " << client.first 
-                         << " | Department: " << client.second.department
-                         << "\nLast seen: " << client.second.last_seen;
-                    if(client.second.has_udp) cout << " [UDP Active]";
-                    cout << "\n----------------------------------------\n";
+            for(const auto& campus : registry_view->by_campus) {
+                for(const SubscriptionGroup *group : campus) {
+                    for(const ClientInfo *client : group->members) {
+                        connected++;
+                        cout << "Campus: " << client->campus 
+                             << " | Department: " << client->department
+                             << "\nLast seen: " << (monotonic_ms() - client->last_seen_ms) / 1000 << "s ago"
+                             << " | Queued: " << client->outbound->pending_bytes << " bytes"
+                             << " | Writes: " << client->outbound->write_calls;
+                        if(client->udp_endpoint != 0) cout << " [UDP Active]";
+                        cout << "\n----------------------------------------\n";
+                    }
                 }
             }
-            cout << "Total connected: " << connected_clients.size() << "\n";
+            if(connected == 0) cout << "No campuses connected.\n";
+            cout << "Total connected: " << connected << "\n";
+        }
+        else if(command == "stats") {
+            uint64_t total_calls = 0, total_bytes = 0;
+            cout << "\n--- Write Batching ---\n";
+            for(const auto &worker : workers) {
+                uint64_t calls = worker->write_calls, bytes = worker->bytes_written;
+                total_calls += calls;
+                total_bytes += bytes;
+                cout << "Worker " << worker->id << ": " << bytes << " bytes in " << calls << " writes\n";
+            }
+            cout << "Average bytes per write: " << (total_calls ? total_bytes / total_calls : 0) << "\n";
+            print_metrics();
         }
         else if(command.find("broadcast:") == 0) {
             string broadcast_msg = command.substr(10);
@@ -348,41 +2989,38 @@ void admin_console(int udp_socket) {
                 continue;
             }
             
-            lock_guard<mutex> lock(clients_mutex);
-            int sent_count = 0;
-            for(const auto& client : connected_clients) {
-                if(client.second.has_udp) {
-                    sendto(udp_socket, broadcast_msg.c_str(), broadcast_msg.size(), 0,
-                          (sockaddr*)&client.second.udp_addr, sizeof(client.second.udp_addr));
-                    sent_count++;
-                }
+            int64_t started = monotonic_ns();
+            vector<BroadcastTarget> targets = snapshot_broadcast_targets();
+            BroadcastResult result = send_broadcast(udp_socket, targets, broadcast_msg);
+            record_stage(STAGE_BROADCAST, started);
+            count_metric(METRIC_BROADCASTS);
+            count_metric(METRIC_BROADCAST_DATAGRAMS, result.sent);
+            count_metric(METRIC_BROADCAST_FAILURES, result.failures.size());
+            int sent_count = result.sent;
+            
+            server_log("Broadcast sent to " + to_string(sent_count) + " campuses in " +
+                       to_string(result.syscalls) + " sendmmsg calls: " + broadcast_msg);
+            for(const auto &failure : result.failures) {
+                log_event(LOG_WARN, "Broadcast to %s failed: %s",
+                          failure.campus.c_str(), strerror(failure.error));
+                cout << "Failed: " << failure.campus << " (" << strerror(failure.error) << ")\n";
             }
-            server_log("Broadcast sent to " + to_string(sent_count) + " campuses: " + broadcast_msg);
             cout << "Broadcast sent to " << sent_count << " campuses.\n";
         }
         else if(command == "quit") {
             cout << "\nShutting down server...\n";
             
-            // Close all client sockets
-            {
-                lock_guard<mutex> lock(clients_mutex);
-                for(auto& client : connected_clients) {
-                    if(client.second.tcp_sock != -1) {
-                        shutdown(client.second.tcp_sock, SHUT_RDWR);
-                        close(client.second.tcp_sock);
-                    }
-                }
-                connected_clients.clear();
-                socket_to_campus.clear();
-            }
-            
+            // Each worker closes its client sockets on its way out
+            quit_requested = true;
             server_running = false;
+            wake_all_workers();
             server_log("Server shutdown initiated.");
             break;
         }
         else if(command == "help") {
             cout << "\nAvailable commands:\n";
             cout << "  list                    - Show all connected campuses\n";
+            cout << "  stats                   - Show counters, stage latencies and write batching\n";
             cout << "  broadcast:<message>     - Send message to all campuses\n";
             cout << "  quit                    - Stop the server\n";
             cout << "  help                    - Show this help message\n";
@@ -395,94 +3033,756 @@ void admin_console(int udp_socket) {
     }
 }
 
-void cleanup_sockets(int tcp_socket, int udp_socket) {
-    if(tcp_socket != -1) {
-        shutdown(tcp_socket, SHUT_RDWR);
-        close(tcp_socket);
+void cleanup_sockets(int udp_socket) {
+    for(auto &worker : workers) {
+        if(worker->listen_fd != -1) {
+            // Shutting down a handed-over listener would stop the successor's too
+            if(!handed_over) shutdown(worker->listen_fd, SHUT_RDWR);
+            close(worker->listen_fd);
+            worker->listen_fd = -1;
+        }
+        if(worker->epoll_fd != -1) {
+            close(worker->epoll_fd);
+            worker->epoll_fd = -1;
+        }
+        if(worker->wakeup_fd != -1) {
+            close(worker->wakeup_fd);
+            worker->wakeup_fd = -1;
+        }
     }
     if(udp_socket != -1) {
         close(udp_socket);
     }
 }
 
-int main() {
-    int tcp_socket = -1;
-    int udp_socket = -1;
+int create_udp_socket() {
+    int udp_socket = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(udp_socket < 0) {
+        perror("UDP socket creation failed");
+        return -1;
+    }
     
-    try {
-        // Create TCP server socket
-        tcp_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if(tcp_socket < 0) {
-            perror("TCP socket creation failed");
-            return 1;
+    // Bind UDP socket
+    sockaddr_in udp_addr{};
+    udp_addr.sin_family = AF_INET;
+    udp_addr.sin_addr.s_addr = INADDR_ANY;
+    udp_addr.sin_port = htons(UDP_PORT);
+    
+    if(bind(udp_socket, (sockaddr*)&udp_addr, sizeof(udp_addr)) < 0) {
+        perror("UDP bind failed");
+        close(udp_socket);
+        return -1;
+    }
+    return udp_socket;
+}
+
+// Every worker binds its own listener to TCP_PORT; SO_REUSEPORT lets the
+// kernel spread incoming connections across them.
+int create_tcp_listener() {
+    int tcp_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if(tcp_socket < 0) {
+        perror("TCP socket creation failed");
+        return -1;
+    }
+    
+    // Set socket options
+    int opt = 1;
+    setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+    setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEPORT, &opt, sizeof(opt));
+    
+    // Bind TCP socket
+    sockaddr_in tcp_addr{};
+    tcp_addr.sin_family = AF_INET;
+    tcp_addr.sin_addr.s_addr = INADDR_ANY;
+    tcp_addr.sin_port = htons(TCP_PORT);
+    
+    if(bind(tcp_socket, (sockaddr*)&tcp_addr, sizeof(tcp_addr)) < 0) {
+        perror("TCP bind failed");
+        close(tcp_socket);
+        return -1;
+    }
+    
+    // Listen for TCP connections
+    if(listen(tcp_socket, listen_backlog) < 0) {
+        perror("TCP listen failed");
+        close(tcp_socket);
+        return -1;
+    }
+    return tcp_socket;
+}
+
+// --metrics-listen: a port, bound to 127.0.0.1 only, or a Unix socket path
+int create_metrics_listener(const string &address) {
+    int fd;
+    if(address.find('/') != string::npos) {
+        sockaddr_un unix_addr{};
+        if(address.size() >= sizeof(unix_addr.sun_path)) {
+            cerr << "Metrics socket path too long: " << address << "\n";
+            return -1;
         }
-        
-        // Set socket options
-        int opt = 1;
-        setsockopt(tcp_socket, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
-        
-        // Bind TCP socket
+        unix_addr.sun_family = AF_UNIX;
+        memcpy(unix_addr.sun_path, address.c_str(), address.size() + 1);
+        unlink(address.c_str());    // Left behind by an earlier run
+        fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0 && bind(fd, (sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    } else {
         sockaddr_in tcp_addr{};
         tcp_addr.sin_family = AF_INET;
-        tcp_addr.sin_addr.s_addr = INADDR_ANY;
-        tcp_addr.sin_port = htons(TCP_PORT);
+        tcp_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        tcp_addr.sin_port = htons((uint16_t)atoi(address.c_str()));
+        int opt = 1;
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if(fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        if(fd >= 0 && bind(fd, (sockaddr*)&tcp_addr, sizeof(tcp_addr)) < 0) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    if(fd < 0 || listen(fd, 16) < 0) {
+        perror("Metrics endpoint setup failed");
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Answer one scrape: any GET of / or /metrics gets the exposition text
+void serve_scrape(int fd) {
+    timeval timeout{METRICS_REQUEST_TIMEOUT_MS / 1000, (METRICS_REQUEST_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    
+    string request;
+    char buffer[1024];
+    while(request.find("\r\n\r\n") == string::npos && request.size() < sizeof(buffer) * 8) {
+        ssize_t n = recv(fd, buffer, sizeof(buffer), 0);
+        if(n <= 0) break;
+        request.append(buffer, n);
+    }
+    bool found = request.rfind("GET /metrics", 0) == 0 || request.rfind("GET / ", 0) == 0;
+    string body = found ? format_prometheus() : "Not found\n";
+    string response = string("HTTP/1.1 ") + (found ? "200 OK" : "404 Not Found") + "\r\n" +
+                      "Content-Type: text/plain; version=0.0.4; charset=utf-8\r\n" +
+                      "Content-Length: " + to_string(body.size()) + "\r\nConnection: close\r\n\r\n" + body;
+    size_t offset = 0;
+    while(offset < response.size()) {
+        ssize_t n = send(fd, response.data() + offset, response.size() - offset, MSG_NOSIGNAL);
+        if(n <= 0) break;
+        offset += n;
+    }
+}
+
+// Scrapes are rare and small, so one blocking connection at a time keeps
+// the endpoint off the workers entirely
+void metrics_loop(int listen_fd) {
+    while(server_running) {
+        pollfd ready{listen_fd, POLLIN, 0};
+        if(poll(&ready, 1, METRICS_POLL_INTERVAL_MS) <= 0) continue;
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(client < 0) continue;
+        serve_scrape(client);
+        close(client);
+    }
+}
+
+// ---- Hot restart ----
+// With --handoff PATH a server first asks whoever listens on PATH for its
+// sockets (request_handoff), then listens there itself for the next
+// upgrade (handoff_loop, hand_over). See handoff.h for the exchange.
+
+// The successor connects here; a socket left behind by an earlier run is replaced
+int create_handoff_listener(const string &path) {
+    sockaddr_un unix_addr{};
+    unix_addr.sun_family = AF_UNIX;
+    memcpy(unix_addr.sun_path, path.c_str(), path.size() + 1);
+    unlink(path.c_str());
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(fd < 0 || bind(fd, (sockaddr*)&unix_addr, sizeof(unix_addr)) < 0 || chmod(path.c_str(), 0600) < 0 ||
+       listen(fd, 1) < 0) {
+        perror("Handoff socket setup failed");
+        if(fd >= 0) close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void set_handoff_timeouts(int fd) {
+    timeval timeout{HANDOFF_TIMEOUT_MS / 1000, (HANDOFF_TIMEOUT_MS % 1000) * 1000};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+}
+
+// Wait for a successor's request, then stop the workers the way "quit"
+// does. With connections wanted they stop without closing anything, and
+// main passes it all on once they are out of their event loops.
+void handoff_loop(int listen_fd, int *peer) {
+    while(server_running) {
+        pollfd ready{listen_fd, POLLIN, 0};
+        if(poll(&ready, 1, HANDOFF_POLL_INTERVAL_MS) <= 0) continue;
+        int client = accept4(listen_fd, nullptr, nullptr, SOCK_CLOEXEC);
+        if(client < 0) continue;
         
-        if(bind(tcp_socket, (sockaddr*)&tcp_addr, sizeof(tcp_addr)) < 0) {
-            perror("TCP bind failed");
-            cleanup_sockets(tcp_socket, udp_socket);
-            return 1;
+        // Only our own user may take our sockets
+        ucred credentials{};
+        socklen_t length = sizeof(credentials);
+        uint8_t type = 0, flags = 0;
+        string payload;
+        HandoffReader reader(client);
+        set_handoff_timeouts(client);
+        if(getsockopt(client, SOL_SOCKET, SO_PEERCRED, &credentials, &length) < 0 ||
+           credentials.uid != geteuid() || !reader.read_record(type, payload) ||
+           type != HANDOFF_REQUEST || !decode_handoff_request(payload, flags)) {
+            log_event(LOG_WARN, "Ignoring invalid handoff request");
+            close(client);
+            continue;
         }
         
-        // Listen for TCP connections
-        if(listen(tcp_socket, 10) < 0) {
-            perror("TCP listen failed");
-            cleanup_sockets(tcp_socket, udp_socket);
-            return 1;
+        hand_over_connections = (flags & HANDOFF_WANT_CONNECTIONS) != 0;
+        *peer = client;
+        server_log(string("Handing over to a new server process") +
+                   (hand_over_connections ? ", connections included" : ""));
+        server_running = false;
+        wake_all_workers();
+        return;
+    }
+}
+
+// Everything a successor needs to carry on with conn where we stopped
+HandoffConnection snapshot_connection(const Connection &conn) {
+    HandoffConnection state;
+    state.fd = conn.fd;
+    state.conn_id = conn.id;
+    state.active = conn.state == ConnState::ACTIVE;
+    state.proto = (uint8_t)conn.proto;
+    state.frame_flags = conn.frame_flags;
+    state.credit_window = conn.credit_window;
+    state.uncredited = conn.uncredited;
+    state.campus_id = conn.campus_id;
+    state.department = conn.department;
+    state.input = conn.in_buf;
+    state.output = conn.sending;
+    state.written = conn.send_offset;
+    state.output += conn.staged;
+    {
+        lock_guard<mutex> lock(conn.outbound->lock);
+        state.output += conn.outbound->buffer;
+    }
+    if(conn.registration) {
+        state.udp_endpoint = conn.registration->udp_endpoint.load();
+        state.last_seen_ms = conn.registration->last_seen_ms.load();
+    }
+    return state;
+}
+
+// Send the successor our listeners, our connections if it asked for them,
+// and, once the spool is closed for it to open, the end of the handoff.
+// False unless HANDOFF_DONE was written: the successor gives up without it,
+// so the caller resumes serving (resume_serving) with everything it still has.
+bool hand_over(int peer, int udp_socket) {
+    string record;
+    vector<int> listeners = {udp_socket};
+    for(const auto &worker : workers) listeners.push_back(worker->listen_fd);
+    begin_handoff_record(record, HANDOFF_LISTENERS);
+    handoff_put_u32(record, (uint32_t)workers.size());
+    finish_handoff_record(record);
+    if(!send_handoff_record(peer, record, listeners.data(), listeners.size())) return false;
+    
+    size_t handed = 0;
+    if(hand_over_connections) {
+        for(const auto &worker : workers) {
+            for(const auto &conn : worker->connections) {
+                HandoffConnection state = snapshot_connection(conn.second);
+                encode_handoff_connection(record, state);
+                if(!send_handoff_record(peer, record, &state.fd, 1)) return false;
+                handed++;
+            }
+        }
+    }
+    
+    stop_spool();
+    begin_handoff_record(record, HANDOFF_DONE);
+    handoff_put_u64(record, next_conn_id);
+    handoff_put_u32(record, compress_dictionary_id);
+    finish_handoff_record(record);
+    if(!send_handoff_record(peer, record)) return false;
+    handed_over = true;
+    server_log("Handed over " + to_string(workers.size()) + " listener(s) and " + to_string(handed) +
+               " connection(s)");
+    
+    // Ours to close, the successor's to keep open
+    for(const auto &worker : workers) {
+        for(const auto &conn : worker->connections) close(conn.first);
+        worker->connections.clear();
+    }
+    return true;
+}
+
+// Put a stopped worker's sockets back in service. Under epoll they stay
+// registered, but edge-triggered readiness reported to the loop that quit
+// is gone; re-arming reports whatever is ready now.
+bool resume_worker(Worker &worker, int udp_socket) {
+#ifdef NU_HAVE_IO_URING
+    if(io_backend == IoBackend::IO_URING) return setup_uring(worker, udp_socket);
+#endif
+    vector<int> fds = {worker.listen_fd, worker.wakeup_fd};
+    if(worker.id == 0) fds.push_back(udp_socket);
+    
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLET;
+    for(int fd : fds) {
+        ev.data.fd = fd;
+        if(epoll_ctl(worker.epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0) return false;
+    }
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    for(const auto &conn : worker.connections) {
+        ev.data.fd = conn.first;
+        if(epoll_ctl(worker.epoll_fd, EPOLL_CTL_MOD, conn.first, &ev) < 0) return false;
+    }
+    return true;
+}
+
+// Carry on after a handoff that failed: the successor closes whatever it
+// received, so our listeners and connections are still ours alone. False
+// if the spool or a worker cannot be restarted.
+bool resume_serving(int udp_socket) {
+    hand_over_connections = false;
+    if(!spool_running && !start_spool()) return false;
+    for(auto &worker : workers) {
+        if(!resume_worker(*worker, udp_socket)) return false;
+    }
+    server_running = true;
+    return true;
+}
+
+// What the previous server handed over; see request_handoff
+struct HandedOver {
+    int udp_socket = -1;
+    vector<int> listeners;
+    vector<HandoffConnection> connections;
+    uint64_t next_conn_id = 1;
+    uint32_t dictionary_id = 0;
+};
+
+enum class HandoffResult {
+    NO_SERVER,      // Nobody listens on handoff_path: a normal start
+    TAKEN_OVER,
+    FAILED          // The previous server stopped partway; nothing was kept
+};
+
+// Ask the server listening on handoff_path for its sockets. Returns once it
+// has closed its spool, so ours can open.
+HandoffResult request_handoff(HandedOver &handoff) {
+    sockaddr_un unix_addr{};
+    unix_addr.sun_family = AF_UNIX;
+    memcpy(unix_addr.sun_path, handoff_path.c_str(), handoff_path.size() + 1);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if(sock < 0) return HandoffResult::FAILED;
+    if(connect(sock, (sockaddr*)&unix_addr, sizeof(unix_addr)) < 0) {
+        close(sock);
+        return HandoffResult::NO_SERVER;
+    }
+    set_handoff_timeouts(sock);
+    
+    string record, payload;
+    encode_handoff_request(record, handoff_clients ? HANDOFF_WANT_CONNECTIONS : 0);
+    HandoffReader reader(sock);
+    bool ok = send_handoff_record(sock, record);
+    bool done = false;
+    uint8_t type = 0;
+    while(ok && !done && reader.read_record(type, payload)) {
+        HandoffCursor cursor{payload};
+        if(type == HANDOFF_LISTENERS) {
+            uint32_t count = cursor.u32();
+            handoff.udp_socket = reader.take_fd();
+            for(uint32_t i = 0; cursor.ok && i < count; i++) handoff.listeners.push_back(reader.take_fd());
+            ok = cursor.ok && handoff.udp_socket >= 0 &&
+                 find(handoff.listeners.begin(), handoff.listeners.end(), -1) == handoff.listeners.end();
+        } else if(type == HANDOFF_CONNECTION) {
+            HandoffConnection state;
+            ok = decode_handoff_connection(payload, state);
+            state.fd = reader.take_fd();
+            ok = ok && state.fd >= 0;
+            if(state.fd >= 0) handoff.connections.push_back(move(state));
+        } else if(type == HANDOFF_DONE) {
+            handoff.next_conn_id = cursor.u64();
+            handoff.dictionary_id = cursor.u32();
+            ok = done = cursor.ok;
+        } else {
+            ok = false;
+        }
+    }
+    close(sock);
+    if(done) return HandoffResult::TAKEN_OVER;
+    
+    for(int fd : handoff.listeners) close(fd);
+    for(const auto &state : handoff.connections) close(state.fd);
+    if(handoff.udp_socket >= 0) close(handoff.udp_socket);
+    handoff = HandedOver();
+    return HandoffResult::FAILED;
+}
+
+// Rebuild the handed-over connections, dealt round-robin to the workers,
+// and make the authenticated ones routable in one registry publish, all
+// before any worker runs. A connection whose dictionary we do not share is
+// closed instead, its queue spooled, and renegotiates when it reconnects.
+void adopt_connections(HandedOver &handoff) {
+    vector<shared_ptr<ClientInfo>> added;
+    size_t next_worker = 0;
+    for(HandoffConnection &state : handoff.connections) {
+        Worker &worker = *workers[next_worker++ % workers.size()];
+        bool known = !state.active || (state.campus_id >= 0 && (size_t)state.campus_id < campus_names.size());
+        bool usable = known && (!(state.frame_flags & FRAME_FLAG_DICTIONARY) ||
+                                handoff.dictionary_id == compress_dictionary_id);
+        if(usable && io_backend == IoBackend::EPOLL) {
+            epoll_event ev{};
+            ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+            ev.data.fd = state.fd;
+            usable = epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, state.fd, &ev) == 0;
+        }
+        if(!usable) {
+            if(state.active && known) {
+                lock_guard<mutex> lock(spool_mutex);
+                spool_queued(state.campus_id, state.department, state.proto, state.output, state.written);
+            }
+            shutdown(state.fd, SHUT_RDWR);
+            close(state.fd);
+            continue;
         }
         
-        server_log("TCP server listening on port " + to_string(TCP_PORT));
+        count_metric(METRIC_CONNECTIONS_ADOPTED);
+        Connection &conn = worker.connections[state.fd];
+        conn.fd = state.fd;
+        conn.id = state.conn_id;
+        conn.proto = state.proto;
+        conn.frame_flags = state.frame_flags;
+        conn.credit_window = state.credit_window;
+        conn.uncredited = state.uncredited;
+        conn.in_buf = move(state.input);
+        conn.sending = move(state.output);
+        conn.send_offset = state.written;
+        conn.outbound->pending_bytes = conn.sending.size() - conn.send_offset;
+        if(!state.active) continue;
         
-        // Create UDP server socket
-        udp_socket = socket(AF_INET, SOCK_DGRAM, 0);
-        if(udp_socket < 0) {
-            perror("UDP socket creation failed");
-            cleanup_sockets(tcp_socket, udp_socket);
+        conn.state = ConnState::ACTIVE;
+        conn.campus_id = state.campus_id;
+        conn.campus = campus_names[state.campus_id];
+        conn.department = state.department;
+        auto client_info = make_registration(conn, worker.id);
+        client_info->udp_endpoint = state.udp_endpoint;
+        client_info->last_seen_ms = state.last_seen_ms;
+        conn.registration = client_info;
+        added.push_back(client_info);
+    }
+    if(added.empty()) return;
+    update_registry([&](vector<shared_ptr<ClientInfo>> &clients) {
+        clients.insert(clients.end(), added.begin(), added.end());
+    });
+}
+
+// Register listener, wakeup descriptor and (worker 0) the UDP socket. A
+// listener handed over by a previous server (listen_fd) is used as it is,
+// queued connections and all; otherwise the worker binds its own.
+bool setup_worker(Worker &worker, int udp_socket, int listen_fd = -1) {
+    worker.listen_fd = listen_fd >= 0 ? listen_fd : create_tcp_listener();
+    if(worker.listen_fd < 0) return false;
+    // Our --listen-backlog, not the old server's
+    if(listen_fd >= 0) listen(listen_fd, listen_backlog);
+    
+    worker.epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    worker.wakeup_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(worker.epoll_fd < 0 || worker.wakeup_fd < 0) {
+        perror("Reactor setup failed");
+        return false;
+    }
+    
+    vector<int> fds = {worker.listen_fd, worker.wakeup_fd};
+    if(worker.id == 0) fds.push_back(udp_socket);
+    
+    for(int fd : fds) {
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.fd = fd;
+        if(epoll_ctl(worker.epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+            perror("epoll_ctl failed");
+            return false;
+        }
+    }
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    int udp_socket = -1;
+    int worker_count = 1;
+    string log_path;
+    string metrics_address;     // --metrics-listen; empty = no endpoint
+    
+    for(int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if(arg == "--workers" && i + 1 < argc) {
+            worker_count = atoi(argv[++i]);
+        } else if(arg == "--log-level" && i + 1 < argc) {
+            string level = argv[++i];
+            if(level == "debug") log_level = LOG_DEBUG;
+            else if(level == "info") log_level = LOG_INFO;
+            else if(level == "warn") log_level = LOG_WARN;
+            else if(level == "error") log_level = LOG_ERROR;
+            else {
+                cout << "Unknown log level: " << level << "\n";
+                return 1;
+            }
+        } else if(arg == "--log-file" && i + 1 < argc) {
+            log_path = argv[++i];
+        } else if(arg == "--delivery" && i + 1 < argc) {
+            string mode = argv[++i];
+            if(mode == "fanout") delivery_mode = DeliveryMode::FANOUT;
+            else if(mode == "round-robin") delivery_mode = DeliveryMode::ROUND_ROBIN;
+            else if(mode == "least-queued") delivery_mode = DeliveryMode::LEAST_QUEUED;
+            else {
+                cout << "Unknown delivery mode: " << mode << "\n";
+                return 1;
+            }
+        } else if(arg == "--flush-delay-ms" && i + 1 < argc) {
+            flush_delay_ms = max(0, atoi(argv[++i]));
+        } else if(arg == "--spool-dir" && i + 1 < argc) {
+            spool_dir = argv[++i];
+        } else if(arg == "--heartbeat-interval" && i + 1 < argc) {
+            heartbeat_interval = atoi(argv[++i]);
+        } else if(arg == "--heartbeat-misses" && i + 1 < argc) {
+            heartbeat_misses = atoi(argv[++i]);
+        } else if(arg == "--compress-dict" && i + 1 < argc) {
+            string path = argv[++i];
+            if(!load_dictionary(path, compress_dictionary)) {
+                cout << "Cannot read compression dictionary: " << path << "\n";
+                return 1;
+            }
+            compress_dictionary_id = dictionary_id(compress_dictionary);
+        } else if(arg == "--slow-consumer" && i + 1 < argc) {
+            string policy = argv[++i];
+            if(policy == "block") slow_consumer_policy = SlowConsumerPolicy::BLOCK;
+            else if(policy == "shed-oldest") slow_consumer_policy = SlowConsumerPolicy::SHED_OLDEST;
+            else if(policy == "shed-newest") slow_consumer_policy = SlowConsumerPolicy::SHED_NEWEST;
+            else if(policy == "disconnect") slow_consumer_policy = SlowConsumerPolicy::DISCONNECT;
+            else {
+                cout << "Unknown slow-consumer policy: " << policy << "\n";
+                return 1;
+            }
+        } else if(arg == "--max-queued-bytes" && i + 1 < argc) {
+            max_queued_bytes = strtoull(argv[++i], nullptr, 10);
+        } else if(arg == "--listen-backlog" && i + 1 < argc) {
+            listen_backlog = atoi(argv[++i]);
+        } else if(arg == "--session-ttl" && i + 1 < argc) {
+            session_ttl = max(0, atoi(argv[++i]));
+        } else if(arg == "--session-key" && i + 1 < argc) {
+            session_key_path = argv[++i];
+        } else if(arg == "--metrics-listen" && i + 1 < argc) {
+            metrics_address = argv[++i];
+        } else if(arg == "--handoff" && i + 1 < argc) {
+            handoff_path = argv[++i];
+        } else if(arg == "--handoff-clients") {
+            handoff_clients = true;
+        } else if(arg == "--io-backend" && i + 1 < argc) {
+            string backend = argv[++i];
+            if(backend == "epoll") io_backend = IoBackend::EPOLL;
+            else if(backend == "io_uring") io_backend = IoBackend::IO_URING;
+            else {
+                cout << "Unknown I/O backend: " << backend << "\n";
+                return 1;
+            }
+        } else {
+            cout << "Usage: " << argv[0] << " [--workers N] [--log-level debug|info|warn|error]"
+                 << " [--log-file PATH] [--delivery fanout|round-robin|least-queued]"
+                 << " [--flush-delay-ms MS] [--spool-dir DIR]"
+                 << " [--heartbeat-interval SECONDS] [--heartbeat-misses N]"
+                 << " [--io-backend epoll|io_uring] [--compress-dict FILE]"
+                 << " [--slow-consumer block|shed-oldest|shed-newest|disconnect]"
+                 << " [--max-queued-bytes N] [--listen-backlog N]"
+                 << " [--session-ttl SECONDS] [--session-key FILE] [--metrics-listen PORT|PATH]"
+                 << " [--handoff PATH [--handoff-clients]]\n";
+            return 1;
+        }
+    }
+    if(worker_count < 1) {
+        cout << "Worker count must be at least 1\n";
+        return 1;
+    }
+    if(listen_backlog < 1) {
+        cout << "Listen backlog must be at least 1\n";
+        return 1;
+    }
+    if(heartbeat_interval < 1 || heartbeat_misses < 1) {
+        cout << "Heartbeat interval and misses must be at least 1\n";
+        return 1;
+    }
+    if(handoff_clients && handoff_path.empty()) {
+        cout << "--handoff-clients needs --handoff\n";
+        return 1;
+    }
+    if(handoff_path.size() >= sizeof(sockaddr_un::sun_path)) {
+        cout << "Handoff socket path too long: " << handoff_path << "\n";
+        return 1;
+    }
+    
+    if(!start_logger(log_path)) return 1;
+    // Flush and stop the logger on every way out of main
+    struct LoggerGuard {
+        ~LoggerGuard() { stop_logger(); }
+    } logger_guard;
+    
+    // Empty registry with an (empty) fan-out list per known campus
+    intern_campuses();
+    auto *initial_registry = new RegistrySnapshot();
+    index_registry(*initial_registry);
+    registry = initial_registry;
+    
+    // Take over from a server listening on --handoff PATH, if there is one.
+    // It closes its spool at the very end, so ours is opened only after.
+    HandedOver handoff;
+    if(!handoff_path.empty()) {
+        HandoffResult result = request_handoff(handoff);
+        if(result == HandoffResult::FAILED) {
+            log_event(LOG_ERROR, "Handoff from the server on %s failed", handoff_path.c_str());
+            return 1;
+        }
+        if(result == HandoffResult::TAKEN_OVER) {
+            server_log("Took over " + to_string(handoff.listeners.size()) + " listener(s) and " +
+                       to_string(handoff.connections.size()) + " connection(s) from the previous server");
+        }
+    }
+    
+    if(!start_spool()) return 1;
+    // Declared after logger_guard, so the final msync can still log
+    struct SpoolGuard {
+        ~SpoolGuard() { stop_spool(); }
+    } spool_guard;
+    
+    // Kept with the spool by default, so tokens outlive a restart
+    if(session_ttl > 0) {
+        string key_path = session_key_path.empty() ? spool_dir + "/session.key" : session_key_path;
+        if(!load_session_key(key_path, session_key)) {
+            log_event(LOG_ERROR, "Cannot read or create session key %s: %s", key_path.c_str(), strerror(errno));
             return 1;
         }
+    }
+    
+    try {
+        udp_socket = handoff.udp_socket >= 0 ? handoff.udp_socket : create_udp_socket();
+        if(udp_socket < 0) return 1;
         
-        // Bind UDP socket
-        sockaddr_in udp_addr{};
-        udp_addr.sin_family = AF_INET;
-        udp_addr.sin_addr.s_addr = INADDR_ANY;
-        udp_addr.sin_port = htons(UDP_PORT);
+        // Create one event loop (and TCP listener) per worker. Every listener
+        // handed over needs a worker, or connections queued on it wait forever.
+        int handed_listeners = (int)handoff.listeners.size();
+        worker_count = max(worker_count, handed_listeners);
+        for(int i = 0; i < worker_count; i++) {
+            workers.emplace_back(new Worker());
+            workers.back()->id = i;
+            if(!setup_worker(*workers.back(), udp_socket, i < handed_listeners ? handoff.listeners[i] : -1)) {
+                cleanup_sockets(udp_socket);
+                return 1;
+            }
+        }
         
-        if(bind(udp_socket, (sockaddr*)&udp_addr, sizeof(udp_addr)) < 0) {
-            perror("UDP bind failed");
-            cleanup_sockets(tcp_socket, udp_socket);
-            return 1;
+        // io_uring needs Linux 6.0+ and may be disabled by policy
+        // (kernel.io_uring_disabled, seccomp); epoll always works
+        if(io_backend == IoBackend::IO_URING) {
+#ifdef NU_HAVE_IO_URING
+            for(auto &worker : workers) {
+                if(setup_uring(*worker, udp_socket)) continue;
+                log_event(LOG_WARN, "io_uring unavailable (%s), using epoll", strerror(errno));
+                for(auto &other : workers) release_uring(*other);
+                io_backend = IoBackend::EPOLL;
+                break;
+            }
+#else
+            log_event(LOG_WARN, "Built without io_uring support, using epoll");
+            io_backend = IoBackend::EPOLL;
+#endif
         }
         
+        if(!handoff.connections.empty()) adopt_connections(handoff);
+        next_conn_id = max(next_conn_id.load(), handoff.next_conn_id);
+        
+        server_log("TCP server listening on port " + to_string(TCP_PORT) +
+                   " (" + to_string(worker_count) + " worker" + (worker_count > 1 ? "s" : "") + ", " +
+                   (io_backend == IoBackend::IO_URING ? "io_uring" : "epoll") + ")");
         server_log("UDP server listening on port " + to_string(UDP_PORT));
         server_log("NU Information Exchange System started successfully!");
         cout << "\nServer is running. Type 'quit' to stop.\n";
         
-        // Start server threads
-        thread tcp_thread(tcp_server_loop, tcp_socket);
-        thread udp_thread(udp_server_loop, udp_socket);
         thread admin_thread(admin_console, udp_socket);
+        int handoff_fd = handoff_path.empty() ? -1 : create_handoff_listener(handoff_path);
+        if(handoff_fd >= 0) server_log("Handoff socket listening on " + handoff_path);
         
-        // Wait for threads to finish
-        tcp_thread.join();
-        udp_thread.join();
-        admin_thread.join();
+        // Serve until "quit" or a completed handoff. One that fails before
+        // the successor has everything leaves us to carry on.
+        while(true) {
+            // Start server threads; pin workers only when there is more than one
+            vector<thread> worker_threads;
+            for(auto &worker : workers) {
+#ifdef NU_HAVE_IO_URING
+                if(io_backend == IoBackend::IO_URING) {
+                    worker_threads.emplace_back(uring_reactor_loop, worker.get(), udp_socket, worker_count > 1);
+                    continue;
+                }
+#endif
+                worker_threads.emplace_back(reactor_loop, worker.get(), udp_socket, worker_count > 1);
+            }
+            
+            int metrics_fd = metrics_address.empty() ? -1 : create_metrics_listener(metrics_address);
+            thread metrics_thread;
+            if(metrics_fd >= 0) {
+                server_log("Metrics endpoint listening on " + metrics_address);
+                metrics_thread = thread(metrics_loop, metrics_fd);
+            }
+            
+            int handoff_peer = -1;      // Set by handoff_loop when a successor asks
+            thread handoff_thread;
+            if(handoff_fd >= 0) handoff_thread = thread(handoff_loop, handoff_fd, &handoff_peer);
+            
+            // Wait for threads to finish
+            for(auto &worker_thread : worker_threads) worker_thread.join();
+            if(handoff_thread.joinable()) handoff_thread.join();
+            if(metrics_thread.joinable()) metrics_thread.join();
+            if(metrics_fd >= 0) {
+                close(metrics_fd);
+                if(metrics_address.find('/') != string::npos) unlink(metrics_address.c_str());
+            }
+            if(handoff_peer < 0) break;
+            
+            // The metrics endpoint is closed first: the successor binds its own
+            // as soon as the handoff ends
+            bool done = hand_over(handoff_peer, udp_socket);
+            if(!done) log_event(LOG_ERROR, "Handoff failed (%s)", strerror(errno));
+            close(handoff_peer);
+            if(done) break;
+            if(!quit_requested && resume_serving(udp_socket)) {
+                server_log("Handoff abandoned; still serving");
+                continue;
+            }
+            for(auto &worker : workers) {
+                current_worker = worker.get();
+                close_all_connections(*worker);
+            }
+            break;
+        }
+        if(handoff_fd >= 0) {
+            close(handoff_fd);
+            // After a handoff the path is the successor's
+            if(!handed_over) unlink(handoff_path.c_str());
+        }
+        // Unless "quit" ended it, the console is still waiting for a line
+        if(quit_requested) admin_thread.join();
+        else admin_thread.detach();
         
     } catch (const exception& e) {
         cerr << "Exception: " << e.what() << endl;
     }
     
     // Final cleanup
-    cleanup_sockets(tcp_socket, udp_socket);
+    cleanup_sockets(udp_socket);
     
     server_log("Server stopped.");
     return 0;
-}
\ No newline at end of file
+}
@@ -0,0 +1,152 @@
+// session.h - Resumable session tokens for server.cpp
+// CN Project Fall 2025 - NU Information Exchange System
+//
+// AUTH_OK carries ",Session:<token>". Until the token expires a client may
+// authenticate with "Session:<token>" instead of Campus/Pass/Dept and comes
+// back as the same campus department, without a credential check.
+//
+// A token needs no table on the server: it holds the campus id, department
+// and expiry (Unix seconds), sealed with a SipHash-2-4 MAC under a 128-bit
+// key the server keeps in a file, so tokens stay valid across a restart.
+// On the wire it is hex:
+//
+//   offset  size  field
+//   0       1     SESSION_TOKEN_VERSION
+//   1       2     campus id
+//   3       8     expiry
+//   11      n     department
+//   11+n    8     MAC of everything before it
+#ifndef NU_SESSION_H
+#define NU_SESSION_H
+
+#include <fcntl.h>          // open
+#include <sys/random.h>     // getrandom
+#include <unistd.h>         // read, write, close
+#include <cstdint>          // Fixed-width integers
+#include <cstring>          // memcpy
+#include <endian.h>         // Byte order conversion
+#include <string>           // String class
+#include <string_view>      // Token views
+
+#define SESSION_TOKEN_VERSION 1
+#define SESSION_KEY_SIZE 16
+#define SESSION_MAC_SIZE 8
+
+struct SessionKey {
+    uint64_t k0 = 0;
+    uint64_t k1 = 0;
+};
+
+inline uint64_t rotate_left(uint64_t value, int bits) {
+    return (value << bits) | (value >> (64 - bits));
+}
+
+// SipHash-2-4 of data under key
+inline uint64_t siphash(const SessionKey &key, const unsigned char *data, size_t length) {
+    uint64_t v0 = key.k0 ^ 0x736f6d6570736575ull, v1 = key.k1 ^ 0x646f72616e646f6dull;
+    uint64_t v2 = key.k0 ^ 0x6c7967656e657261ull, v3 = key.k1 ^ 0x7465646279746573ull;
+    auto round = [&]() {
+        v0 += v1; v1 = rotate_left(v1, 13); v1 ^= v0; v0 = rotate_left(v0, 32);
+        v2 += v3; v3 = rotate_left(v3, 16); v3 ^= v2;
+        v0 += v3; v3 = rotate_left(v3, 21); v3 ^= v0;
+        v2 += v1; v1 = rotate_left(v1, 17); v1 ^= v2; v2 = rotate_left(v2, 32);
+    };
+
+    size_t whole = length - length % 8;
+    for(size_t i = 0; i < whole; i += 8) {
+        uint64_t word;
+        memcpy(&word, data + i, 8);
+        word = le64toh(word);
+        v3 ^= word;
+        round();
+        round();
+        v0 ^= word;
+    }
+    uint64_t last = (uint64_t)length << 56;
+    for(size_t i = whole; i < length; i++) last |= (uint64_t)data[i] << (8 * (i - whole));
+    v3 ^= last;
+    round();
+    round();
+    v0 ^= last;
+
+    v2 ^= 0xff;
+    for(int i = 0; i < 4; i++) round();
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+// Read the key from path, or create the file with a fresh random key
+inline bool load_session_key(const std::string &path, SessionKey &key) {
+    unsigned char bytes[SESSION_KEY_SIZE];
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if(fd >= 0) {
+        bool ok = read(fd, bytes, sizeof(bytes)) == (ssize_t)sizeof(bytes);
+        close(fd);
+        if(!ok) return false;
+    } else {
+        if(getrandom(bytes, sizeof(bytes), 0) != (ssize_t)sizeof(bytes)) return false;
+        fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+        if(fd < 0) return false;
+        bool ok = write(fd, bytes, sizeof(bytes)) == (ssize_t)sizeof(bytes);
+        close(fd);
+        if(!ok) return false;
+    }
+    memcpy(&key.k0, bytes, 8);
+    memcpy(&key.k1, bytes + 8, 8);
+    return true;
+}
+
+inline std::string issue_session_token(const SessionKey &key, uint16_t campus_id, std::string_view department,
+                                       int64_t expires) {
+    std::string raw(1, (char)SESSION_TOKEN_VERSION);
+    uint16_t net_campus = htobe16(campus_id);
+    uint64_t net_expires = htobe64((uint64_t)expires);
+    raw.append((const char*)&net_campus, 2);
+    raw.append((const char*)&net_expires, 8);
+    raw.append(department.data(), department.size());
+    uint64_t mac = htobe64(siphash(key, (const unsigned char*)raw.data(), raw.size()));
+    raw.append((const char*)&mac, SESSION_MAC_SIZE);
+
+    static const char digits[] = "0123456789abcdef";
+    std::string token;
+    token.reserve(raw.size() * 2);
+    for(unsigned char c : raw) {
+        token += digits[c >> 4];
+        token += digits[c & 15];
+    }
+    return token;
+}
+
+// False for a malformed, forged or expired token
+inline bool verify_session_token(const SessionKey &key, std::string_view token, int64_t now,
+                                 uint16_t &campus_id, std::string &department) {
+    size_t fixed = 11 + SESSION_MAC_SIZE;
+    if(token.size() % 2 != 0 || token.size() / 2 < fixed || token.size() / 2 > fixed + 255) return false;
+    std::string raw(token.size() / 2, '\0');
+    for(size_t i = 0; i < raw.size(); i++) {
+        int value = 0;
+        for(char c : token.substr(i * 2, 2)) {
+            int digit = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if(digit < 0) return false;
+            value = value * 16 + digit;
+        }
+        raw[i] = (char)value;
+    }
+
+    size_t sealed = raw.size() - SESSION_MAC_SIZE;
+    uint64_t mac;
+    memcpy(&mac, raw.data() + sealed, SESSION_MAC_SIZE);
+    // Constant time, so a forger learns nothing from how long a guess took
+    uint64_t difference = be64toh(mac) ^ siphash(key, (const unsigned char*)raw.data(), sealed);
+    if(difference != 0 || raw[0] != (char)SESSION_TOKEN_VERSION) return false;
+
+    uint16_t net_campus;
+    uint64_t net_expires;
+    memcpy(&net_campus, raw.data() + 1, 2);
+    memcpy(&net_expires, raw.data() + 3, 8);
+    if((int64_t)be64toh(net_expires) < now) return false;
+    campus_id = be16toh(net_campus);
+    department.assign(raw.data() + 11, sealed - 11);
+    return true;
+}
+
+#endif
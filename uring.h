@@ -0,0 +1,272 @@
+// uring.h - Minimal io_uring ring used by server.cpp's io_uring backend
+// CN Project Fall 2025 - NU Information Exchange System
+//
+// Talks to the kernel through the raw io_uring syscalls, so the build needs
+// only <linux/io_uring.h>, not liburing. Only what the server uses is here:
+// one ring per worker thread, submission helpers for the handful of opcodes
+// it issues, and provided-buffer rings for multishot receives.
+#ifndef NU_URING_H
+#define NU_URING_H
+
+#include <linux/io_uring.h> // Ring layout, opcodes and flags
+#include <sys/mman.h>       // Ring and buffer mappings
+#include <sys/socket.h>     // msghdr, MSG_NOSIGNAL
+#include <sys/syscall.h>    // io_uring syscall numbers
+#include <unistd.h>         // syscall, close
+#include <cerrno>           // Error number definitions
+#include <csignal>          // _NSIG
+#include <cstdint>          // Fixed-width integers
+#include <cstring>          // memset
+#include <ctime>            // Timeout values
+#include <vector>           // Buffer storage
+
+class IoUring {
+public:
+    IoUring() = default;
+    IoUring(const IoUring&) = delete;
+    IoUring &operator=(const IoUring&) = delete;
+    ~IoUring() { destroy(); }
+
+    // Returns false (with errno set) when the kernel lacks io_uring or the
+    // features the server depends on
+    bool init(unsigned entries) {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        params.flags = IORING_SETUP_COOP_TASKRUN;
+        ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+        if(ring_fd < 0) return false;
+        if(!(params.features & IORING_FEAT_SINGLE_MMAP) || !(params.features & IORING_FEAT_EXT_ARG)) {
+            destroy();
+            errno = ENOSYS;
+            return false;
+        }
+
+        ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        if(sq_size > ring_size) ring_size = sq_size;
+        ring_memory = mmap(nullptr, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                           ring_fd, IORING_OFF_SQ_RING);
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void *sqe_memory = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                ring_fd, IORING_OFF_SQES);
+        if(ring_memory == MAP_FAILED || sqe_memory == MAP_FAILED) {
+            if(sqe_memory != MAP_FAILED) munmap(sqe_memory, sqes_size);
+            ring_memory = nullptr;
+            destroy();
+            return false;
+        }
+        sqes = (io_uring_sqe*)sqe_memory;
+
+        char *base = (char*)ring_memory;
+        sq_head = (unsigned*)(base + params.sq_off.head);
+        sq_tail = (unsigned*)(base + params.sq_off.tail);
+        sq_mask = *(unsigned*)(base + params.sq_off.ring_mask);
+        sq_entries = params.sq_entries;
+        cq_head = (unsigned*)(base + params.cq_off.head);
+        cq_tail = (unsigned*)(base + params.cq_off.tail);
+        cq_mask = *(unsigned*)(base + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe*)(base + params.cq_off.cqes);
+
+        // Slot i of the index array always names sqe i
+        unsigned *array = (unsigned*)(base + params.sq_off.array);
+        for(unsigned i = 0; i < sq_entries; i++) array[i] = i;
+        local_tail = *sq_tail;
+        submitted_tail = local_tail;
+        return true;
+    }
+
+    void destroy() {
+        if(sqes != nullptr) munmap(sqes, sqes_size);
+        if(ring_memory != nullptr) munmap(ring_memory, ring_size);
+        if(ring_fd >= 0) close(ring_fd);
+        sqes = nullptr;
+        ring_memory = nullptr;
+        ring_fd = -1;
+    }
+
+    int fd() const { return ring_fd; }
+
+    bool supports(uint8_t opcode) const {
+        std::vector<char> storage(sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op), 0);
+        io_uring_probe *probe = (io_uring_probe*)storage.data();
+        if(syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, 256) < 0) return false;
+        return opcode <= probe->last_op && (probe->ops[opcode].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    // A zeroed sqe, or nullptr if the submission queue is full even after
+    // handing what is queued to the kernel
+    io_uring_sqe *get_sqe(uint64_t user_data) {
+        unsigned head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+        if(local_tail - head >= sq_entries) {
+            submit_and_wait(0, 0);
+            head = __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+            if(local_tail - head >= sq_entries) return nullptr;
+        }
+        io_uring_sqe *sqe = &sqes[local_tail & sq_mask];
+        local_tail++;
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->user_data = user_data;
+        return sqe;
+    }
+
+    // Submit everything queued and wait for wait_nr completions, at most
+    // timeout_ms (negative = no limit). Timeouts and signals are not errors.
+    int submit_and_wait(unsigned wait_nr, int timeout_ms) {
+        __atomic_store_n(sq_tail, local_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = local_tail - submitted_tail;
+        submitted_tail = local_tail;
+
+        __kernel_timespec timeout{timeout_ms / 1000, (long long)(timeout_ms % 1000) * 1000000};
+        io_uring_getevents_arg arg;
+        memset(&arg, 0, sizeof(arg));
+        arg.sigmask_sz = _NSIG / 8;
+        arg.ts = timeout_ms >= 0 ? (uint64_t)&timeout : 0;
+        unsigned flags = IORING_ENTER_EXT_ARG | (wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0);
+
+        int result = (int)syscall(__NR_io_uring_enter, ring_fd, to_submit, wait_nr, flags, &arg, sizeof(arg));
+        if(result < 0 && (errno == ETIME || errno == EINTR || errno == EBUSY)) return 0;
+        return result;
+    }
+
+    // Call handle(cqe) for every completion available now; returns the count
+    template<typename Handler>
+    unsigned drain_completions(Handler &&handle) {
+        unsigned head = *cq_head;
+        unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+        unsigned count = 0;
+        for(; head != tail; head++, count++) handle(cqes[head & cq_mask]);
+        __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        return count;
+    }
+
+private:
+    int ring_fd = -1;
+    void *ring_memory = nullptr;
+    size_t ring_size = 0;
+    io_uring_sqe *sqes = nullptr;
+    size_t sqes_size = 0;
+    unsigned *sq_head = nullptr, *sq_tail = nullptr;
+    unsigned sq_mask = 0, sq_entries = 0;
+    unsigned *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+    unsigned local_tail = 0;        // Next free sqe
+    unsigned submitted_tail = 0;    // local_tail at the last io_uring_enter
+};
+
+// Submission helpers for the opcodes the server issues. Multishot requests
+// keep posting completions (IORING_CQE_F_MORE) until they fail or are
+// cancelled; the receive ones take their buffer from a BufferRing group.
+
+inline void prep_multishot_accept(io_uring_sqe *sqe, int fd, int flags) {
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = fd;
+    sqe->accept_flags = flags;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+}
+
+inline void prep_multishot_recv(io_uring_sqe *sqe, int fd, uint16_t group) {
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+}
+
+// msg supplies only msg_namelen and msg_controllen; it must outlive the request
+inline void prep_multishot_recvmsg(io_uring_sqe *sqe, int fd, msghdr *msg, uint16_t group) {
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)msg;
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = group;
+}
+
+inline void prep_send(io_uring_sqe *sqe, int fd, const void *data, size_t length) {
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)data;
+    sqe->len = (uint32_t)length;
+    sqe->msg_flags = MSG_NOSIGNAL;
+}
+
+inline void prep_read(io_uring_sqe *sqe, int fd, void *buffer, unsigned length) {
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)buffer;
+    sqe->len = length;
+    sqe->off = (uint64_t)-1;
+}
+
+// Cancel the request submitted with user_data target (a multishot one ends
+// with -ECANCELED)
+inline void prep_cancel(io_uring_sqe *sqe, uint64_t target) {
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = target;
+}
+
+// Fixed-size buffers registered as a provided-buffer group: the kernel picks
+// one per multishot receive completion and the owner hands it back with
+// recycle() once the bytes have been consumed
+class BufferRing {
+public:
+    BufferRing() = default;
+    BufferRing(const BufferRing&) = delete;
+    BufferRing &operator=(const BufferRing&) = delete;
+    ~BufferRing() {
+        if(ring != nullptr) munmap(ring, count * sizeof(io_uring_buf));
+    }
+
+    // count must be a power of two
+    bool init(const IoUring &uring, uint16_t group, unsigned count, unsigned size) {
+        this->count = count;
+        this->size = size;
+        void *memory = mmap(nullptr, count * sizeof(io_uring_buf), PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if(memory == MAP_FAILED) return false;
+        ring = (io_uring_buf_ring*)memory;
+        storage.resize((size_t)count * size);
+
+        io_uring_buf_reg reg;
+        memset(&reg, 0, sizeof(reg));
+        reg.ring_addr = (uint64_t)ring;
+        reg.ring_entries = count;
+        reg.bgid = group;
+        if(syscall(__NR_io_uring_register, uring.fd(), IORING_REGISTER_PBUF_RING, &reg, 1) < 0) return false;
+
+        for(unsigned id = 0; id < count; id++) add((uint16_t)id);
+        publish();
+        return true;
+    }
+
+    char *buffer(uint16_t id) { return storage.data() + (size_t)id * size; }
+
+    void recycle(uint16_t id) {
+        add(id);
+        publish();
+    }
+
+private:
+    void add(uint16_t id) {
+        // Not ring->bufs: in C++ the kernel header's flexible-array wrapper
+        // shifts bufs past the tail field instead of overlaying it
+        io_uring_buf &entry = ((io_uring_buf*)ring)[tail & (count - 1)];
+        entry.addr = (uint64_t)buffer(id);
+        entry.len = size;
+        entry.bid = id;
+        tail++;
+    }
+
+    void publish() { __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE); }
+
+    io_uring_buf_ring *ring = nullptr;
+    std::vector<char> storage;
+    unsigned count = 0;
+    unsigned size = 0;
+    uint16_t tail = 0;
+};
+
+#endif